@@ -44,7 +44,7 @@ int test_function2(void *param)
         printf("server err...\n");
         return ret;
     }
-    ret = server_open(&server, 0);
+    ret = server_open(&server, NULL);
     if (ret < 0)
     {
         printf("server err...\n");
@@ -32,7 +32,14 @@
 #include <ctype.h>
 #include "cJSON.h"
 
+/* Set by the parser of each thread */
+#if defined(LINUX_ENV)
+static __thread const char *ep;
+static __thread int parse_depth;
+#else
 static const char *ep;
+static int parse_depth;
+#endif
 
 const char *cJSON_GetErrorPtr(void) {return ep;}
 
@@ -253,7 +260,7 @@ cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int r
 {
 	const char *end=0;
 	cJSON *c=cJSON_New_Item();
-	ep=0;
+	ep=0;parse_depth=0;
 	if (!c) return 0;       /* memory fail */
 
 	end=parse_value(c,skip(value));
@@ -280,8 +287,16 @@ static const char *parse_value(cJSON *item,const char *value)
 	if (!strncmp(value,"true",4))	{ item->type=cJSON_True; item->valueint=1;	return value+4; }
 	if (*value=='\"')				{ return parse_string(item,value); }
 	if (*value=='-' || (*value>='0' && *value<='9'))	{ return parse_number(item,value); }
-	if (*value=='[')				{ return parse_array(item,value); }
-	if (*value=='{')				{ return parse_object(item,value); }
+	if (*value=='[' || *value=='{')
+	{
+		/* The parser recurses, a deeply nested text would run it out of stack */
+		const char *end;
+		if (parse_depth>=CJSON_NESTING_LIMIT) {ep=value;return 0;}
+		parse_depth++;
+		end=(*value=='[')?parse_array(item,value):parse_object(item,value);
+		parse_depth--;
+		return end;
+	}
 
 	ep=value;return 0;	/* failure. */
 }
@@ -438,7 +453,7 @@ static char *print_object(cJSON *item,int depth,int fmt)
 	/* Explicitly handle empty object case */
 	if (!numentries)
 	{
-		out=(char*)cJSON_malloc(fmt?depth+3:3);
+		out=(char*)cJSON_malloc(fmt?depth+4:3);
 		if (!out)	return 0;
 		ptr=out;*ptr++='{';
 		if (fmt) {*ptr++='\n';for (i=0;i<depth-1;i++) *ptr++='\t';}
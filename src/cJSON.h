@@ -39,6 +39,11 @@ extern "C"
 	
 #define cJSON_IsReference 256
 
+/* Arrays and objects nested deeper than this fail to parse */
+#ifndef CJSON_NESTING_LIMIT
+#define CJSON_NESTING_LIMIT 1000
+#endif
+
 /* The cJSON structure: */
 typedef struct cJSON {
 	struct cJSON *next,*prev;	/* next/prev allow you to walk array/object chains. Alternatively, use GetArraySize/GetArrayItem/GetObjectItem */
@@ -11,6 +11,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
 #define DPRINTF printf
 #define MALLOC malloc
 #define FREE free
@@ -41,8 +45,18 @@
 #define MEMSET UT_MEMSET
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 #define SERVER_PORT 6000
-#define SESSION_MAX_NUM	4
+#define SERVER_BACKLOG	1024 // listen() backlog, the kernel caps it at net.core.somaxconn
+#define SERVER_ACCEPT_BUDGET	64 // max connections accepted per scheduler step
+#define SESSION_MAX_NUM	1024 // sessions of all reactors, unless ServerParamT says otherwise
+#define SERVER_DISPATCH_BUDGET	64 // max socket handlers called per scheduler step
+#define SERVER_REACTOR_MAX	64
+#define SERVER_WORKER_NUM	4 // worker threads for SERVICE_FLAG_OFFLOAD services
+#define SERVER_WORKER_QUEUE_MAX	1024 // offloaded requests waiting for a worker, more get SERVICE_RET_BUSY
 
 
 enum
@@ -0,0 +1,187 @@
+#include "net_arena.h"
+
+#if defined(LINUX_ENV)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define ARENA_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(WIN32)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define ARENA_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(PLATFORM_RT_THREAD)
+#include <rtthread.h>
+#define ARENA_PRINTF rt_kprintf
+#define MALLOC UT_MALLOC
+#define FREE UT_FREE
+#define MEMSET UT_MEMSET
+#endif
+
+#define ARENA_ALIGN 16 // objects are aligned like malloc() does
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+struct _ArenaT
+{
+    char *block;
+    size_t maxSize; // the block doesn't grow beyond it
+    int overflowed; // bool var, an allocation didn't fit since the last reset
+    ArenaStatsT stats;
+};
+
+static int GrowBlock(ArenaT *arena);
+
+/**
+ * @brief Create an arena
+ *
+ * @param [out] pArena get an arena
+ * @param [in] size bytes of the block to start with
+ * @param [in] maxSize the block grows up to this size when it is too small
+ * @return status code
+ */
+int arena_open(ArenaT **pArena, size_t size, size_t maxSize)
+{
+    ArenaT *arena;
+
+    if (size == 0) return ERR_ARENA_UNKNOWN;
+    size = ARENA_ROUND(size);
+    if (maxSize < size) maxSize = size;
+
+    arena = (ArenaT *)MALLOC(sizeof(ArenaT));
+    if (arena == NULL)
+    {
+        return ERR_ARENA_UNKNOWN;
+    }
+    MEMSET(arena, 0, sizeof(ArenaT));
+    arena->block = (char *)MALLOC(size);
+    if (arena->block == NULL)
+    {
+        FREE(arena);
+        return ERR_ARENA_UNKNOWN;
+    }
+    arena->maxSize = maxSize;
+    arena->stats.size = size;
+
+    *pArena = arena;
+    return ERR_ARENA_OK;
+}
+
+/**
+ * @brief Destroy an arena, the objects in it are gone with it
+ *
+ * @param [in, out] pArena [in] an arena get from arena_open(), [out] set to NULL
+ * @return status code
+ */
+int arena_close(ArenaT **pArena)
+{
+    ArenaT *arena = *pArena;
+
+    FREE(arena->block);
+    FREE(arena);
+    *pArena = NULL;
+
+    return ERR_ARENA_OK;
+}
+
+/**
+ * @brief Get memory from the arena, it is released by arena_reset()
+ *
+ * @param [in] arena the arena get from arena_open()
+ * @param [in] size bytes wanted
+ * @return the memory, NULL if the block is full: the caller may take it from
+ * the heap then, the block will be larger after the next reset
+ */
+void* arena_alloc(ArenaT *arena, size_t size)
+{
+    void *ptr;
+
+    size = ARENA_ROUND(size);
+    if (size > arena->stats.size - arena->stats.used)
+    {
+        arena->overflowed = 1;
+        arena->stats.overflowNum++;
+        return NULL;
+    }
+
+    ptr = arena->block + arena->stats.used;
+    arena->stats.used += size;
+    if (arena->stats.used > arena->stats.peak)
+    {
+        arena->stats.peak = arena->stats.used;
+    }
+    return ptr;
+}
+
+/**
+ * @brief Tell whether some memory was get from the arena
+ *
+ * @param [in] arena the arena get from arena_open()
+ * @param [in] ptr the memory
+ * @return 1 if it is in the block of the arena, 0 otherwise
+ */
+int arena_owns(ArenaT *arena, void *ptr)
+{
+    return (char *)ptr >= arena->block && (char *)ptr < arena->block + arena->stats.size;
+}
+
+/**
+ * @brief Release everything get from the arena at once
+ * A block that was too small since the last reset is made larger first
+ *
+ * @param [in] arena the arena get from arena_open()
+ */
+void arena_reset(ArenaT *arena)
+{
+    if (arena->overflowed && arena->stats.size < arena->maxSize)
+    {
+        // Keep the small block if there is no memory for a larger one
+        GrowBlock(arena);
+    }
+    arena->overflowed = 0;
+    arena->stats.used = 0;
+    arena->stats.resetNum++;
+}
+
+/**
+ * @brief Get the usage of an arena
+ *
+ * @param [in] arena the arena get from arena_open()
+ * @param [out] stats the usage since arena_open()
+ * @return status code
+ */
+int arena_get_stats(ArenaT *arena, ArenaStatsT *stats)
+{
+    if (stats == NULL) return ERR_ARENA_UNKNOWN;
+
+    *stats = arena->stats;
+    return ERR_ARENA_OK;
+}
+
+// Double the block, nothing may be in use
+static int GrowBlock(ArenaT *arena)
+{
+    size_t size;
+    char *block;
+
+    size = arena->stats.size * 2;
+    if (size > arena->maxSize) size = arena->maxSize;
+    block = (char *)MALLOC(size);
+    if (block == NULL)
+    {
+        ARENA_PRINTF("[Arena] no memory to grow to %u bytes!\n", (unsigned int)size);
+        return ERR_ARENA_UNKNOWN;
+    }
+    FREE(arena->block);
+    arena->block = block;
+    arena->stats.size = size;
+    arena->stats.growNum++;
+
+    return ERR_ARENA_OK;
+}
+
@@ -0,0 +1,42 @@
+#ifndef __NET_ARENA_H__
+#define __NET_ARENA_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A bump allocator: objects are carved out of one block and all of them are
+// released at once by arena_reset(). Not thread safe, each reactor owns its
+// arena and uses it on its own thread only
+typedef struct _ArenaT ArenaT;
+
+typedef struct _ArenaStatsT
+{
+    size_t size; // bytes of the block
+    size_t used; // bytes handed out since the last reset
+    size_t peak; // max bytes handed out between two resets
+    unsigned long long resetNum; // arena_reset() calls
+    unsigned long long overflowNum; // arena_alloc() calls the block couldn't serve
+    unsigned long long growNum; // times the block was made larger
+} ArenaStatsT;
+
+// Arena Interfaces:
+int arena_open(ArenaT **pArena, size_t size, size_t maxSize);
+int arena_close(ArenaT **pArena);
+void* arena_alloc(ArenaT *arena, size_t size);
+int arena_owns(ArenaT *arena, void *ptr);
+void arena_reset(ArenaT *arena);
+int arena_get_stats(ArenaT *arena, ArenaStatsT *stats);
+
+// Error code
+#define ERR_ARENA_OK		(0)
+#define ERR_ARENA_UNKNOWN		(-600)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __NET_ARENA_H__
+
@@ -1,45 +1,92 @@
 
 #include "config.h"
 #include "cJSON.h"
+#include "net_list.h"
+#include "net_session.h"
 
 
 
-cJSON *recv_request_response(int sock)
+// Receive exactly "len" bytes, returns 0 on success
+static int recv_all(int sock, char *buf, unsigned int len)
 {
     int ret;
-    char len[2];
-    unsigned short dataLen, offset, left;
-    cJSON *json;
-    char *buf;
+    unsigned int offset = 0;
 
-    recv(sock, &len[0], 1, 0);
-    recv(sock, &len[1], 1, 0);
-    dataLen = *(unsigned short *)len;
-    dataLen = ntohs(dataLen);
-    DPRINTF("data len: %d\n", dataLen);
-    if (!dataLen) return NULL;
-    buf = MALLOC(dataLen+1);
-    if (!buf) return NULL;
-
-    left = dataLen;
-    offset = 0;
-    do
+    while (offset < len)
     {
-        ret = recv(sock, buf+offset, 1024, 0);
+        ret = recv(sock, buf+offset, len-offset, 0);
         if (ret < 0)
         {
             DPRINTF("recv() error!\n");
-            break;
+            return -1;
         }
         else if (ret == 0)
         {
-            break;
+            return -1;
         }
+        offset += (unsigned int)ret;
+    }
+    return 0;
+}
+
+// Send the header and the data in one syscall, the 4-byte length follows the
+// escape for long data
+static void send_packet(int sock, char *data, unsigned int dataLen)
+{
+    char header[PACKET_HEADER_EXT_LEN];
+    unsigned short netLen;
+    unsigned int extLen;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    if (dataLen >= PACKET_LEN_ESCAPE)
+    {
+        netLen = htons(PACKET_LEN_ESCAPE);
+        extLen = htonl(dataLen);
+        memcpy(header, &netLen, 2);
+        memcpy(header + 2, &extLen, 4);
+        iov[0].iov_len = PACKET_HEADER_EXT_LEN;
+    }
+    else
+    {
+        netLen = htons((unsigned short)dataLen);
+        memcpy(header, &netLen, 2);
+        iov[0].iov_len = PACKET_HEADER_LEN;
+    }
+    iov[0].iov_base = header;
+    iov[1].iov_base = data;
+    iov[1].iov_len = dataLen;
+    MEMSET(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+cJSON *recv_request_response(int sock)
+{
+    unsigned short netLen;
+    unsigned int dataLen, extLen;
+    cJSON *json;
+    char *buf;
 
-        offset += (unsigned short)ret;
-        left -= (unsigned short)ret;
+    if (recv_all(sock, (char *)&netLen, 2) != 0) return NULL;
+    dataLen = ntohs(netLen);
+    if (dataLen == PACKET_LEN_ESCAPE)
+    {
+        if (recv_all(sock, (char *)&extLen, 4) != 0) return NULL;
+        dataLen = ntohl(extLen);
+    }
+    DPRINTF("data len: %u\n", dataLen);
+    // Don't trust the peer with the allocation, 0xFFFFFFFF would wrap it
+    if (!dataLen || dataLen > SESSION_PACKET_MAX) return NULL;
+    buf = MALLOC(dataLen+1);
+    if (!buf) return NULL;
+
+    if (recv_all(sock, buf, dataLen) != 0)
+    {
+        FREE(buf);
+        return NULL;
     }
-    while (left);
     buf[dataLen] = 0; // end string
     DPRINTF("%s\n", buf);
 
@@ -51,7 +98,6 @@ cJSON *recv_request_response(int sock)
 void send_response(int sock, cJSON *res)
 {
     cJSON *root, *ret;
-    unsigned short dataLen, netLen;
     char *out;
 
     if (!res)
@@ -61,23 +107,16 @@ void send_response(int sock, cJSON *res)
         cJSON_AddNumberToObject(ret,"code", -1);
         cJSON_AddStringToObject(ret, "desc", "Invalid call");
         out = cJSON_Print(root);
-        dataLen = STRLEN(out);
-        netLen = htons(dataLen);
         cJSON_Delete(root);
 
-        send(sock, &netLen, 2, 0);
-        send(sock, out, dataLen, 0);
+        send_packet(sock, out, STRLEN(out));
         FREE(out);
         return;
     }
 
     out = cJSON_Print(res);
-    dataLen = STRLEN(out);
-    netLen = htons(dataLen);
     cJSON_Delete(res);
-    send(sock, &netLen, 2, 0);
-    send(sock, out, dataLen, 0);
+    send_packet(sock, out, STRLEN(out));
     FREE(out);
 
 }
-
@@ -0,0 +1,328 @@
+
+#include "net_coroutine.h"
+
+#if defined(LINUX_ENV)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#define CO_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(PLATFORM_RT_THREAD)
+#include <rtthread.h>
+#define CO_PRINTF rt_kprintf
+#define MALLOC UT_MALLOC
+#define FREE UT_FREE
+#define MEMSET UT_MEMSET
+#endif
+
+#if defined(LINUX_ENV)
+
+struct _CoroutineT
+{
+    ucontext_t ctx;
+    ucontext_t callerCtx; // where we go back to when suspending or finishing
+    struct _CoroutineT *caller; // coroutine that resumed us, NULL for the thread itself
+    SchedulerT *scheduler;
+    SchedProcT proc;
+    void *clientData;
+    SchedProcT cleanUp;
+    char *stack; // the lowest page is a guard page
+    size_t stackSize;
+    int running; // bool var, on the stack of resumed coroutines
+    int finished; // bool var
+    int result; // passed by coroutine_resume(), returned by coroutine_yield()
+    // The scheduler event we are suspended on, every registration holds a
+    // reference and the last one released resumes us with "waitResult"
+    int waitArmed;
+    int waitResult;
+    int waitSock;
+    SchedTaskIdT waitTask;
+};
+
+static __thread CoroutineT *coroutine_current = NULL;
+
+static void CoroutineEntry(void);
+static void CoroutineFree(CoroutineT *co);
+static void CoroutineTimerFire(CoroutineT *co);
+static void CoroutineReadFire(CoroutineT *co);
+static void CoroutineWaitRelease(CoroutineT *co);
+
+/**
+ * @brief Create a coroutine and run it until it suspends for the first time
+ * The Cleanup function is called once the coroutine function has returned,
+ * it is not called if this fails.
+ *
+ * @param [in] scheduler the scheduler of the calling thread, it resumes the coroutine on events
+ * @param [in] stackSize stack size of the coroutine, 0 for COROUTINE_STACK_SIZE
+ * @param [in] proc the coroutine function
+ * @param [in] clientData specific data passed to the coroutine function and Cleanup function
+ * @param [in] cleanUp the Cleanup function for doing cleanup job
+ * @return status code
+ */
+int coroutine_start(SchedulerT *scheduler, unsigned int stackSize, SchedProcT proc, void *clientData, SchedProcT cleanUp)
+{
+    CoroutineT *co;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    if (stackSize == 0) stackSize = COROUTINE_STACK_SIZE;
+    stackSize = (stackSize + pageSize - 1) / pageSize * pageSize;
+
+    co = (CoroutineT *)MALLOC(sizeof(CoroutineT));
+    if (co == NULL)
+    {
+        return ERR_COROUTINE_UNKNOWN;
+    }
+    MEMSET(co, 0, sizeof(CoroutineT));
+    co->scheduler = scheduler;
+    co->proc = proc;
+    co->clientData = clientData;
+    co->cleanUp = cleanUp;
+    co->waitSock = -1;
+    co->waitTask = SCHED_TASK_ID_INVALID;
+
+    co->stackSize = stackSize + pageSize;
+    co->stack = (char *)mmap(NULL, co->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (co->stack == MAP_FAILED)
+    {
+        FREE(co);
+        return ERR_COROUTINE_UNKNOWN;
+    }
+    // An overflow faults on the guard page instead of corrupting the heap
+    mprotect(co->stack, pageSize, PROT_NONE);
+
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + pageSize;
+    co->ctx.uc_stack.ss_size = stackSize;
+    co->ctx.uc_link = &co->callerCtx;
+    makecontext(&co->ctx, CoroutineEntry, 0);
+
+    return coroutine_resume(co, ERR_COROUTINE_OK);
+}
+
+/**
+ * @brief Get the running coroutine
+ *
+ * @return the coroutine, NULL if not called from a coroutine
+ */
+CoroutineT* coroutine_self(void)
+{
+    return coroutine_current;
+}
+
+/**
+ * @brief Suspend the running coroutine until coroutine_resume() is called for it
+ *
+ * @return the result passed to coroutine_resume(), or a negative status code
+ */
+int coroutine_yield(void)
+{
+    CoroutineT *co = coroutine_current;
+
+    if (co == NULL)
+    {
+        return ERR_COROUTINE_NOT_IN_COROUTINE;
+    }
+
+    swapcontext(&co->ctx, &co->callerCtx);
+    return co->result;
+}
+
+/**
+ * @brief Run a suspended coroutine until it suspends again or finishes
+ * Must be called on the thread of the coroutine's scheduler. A finished
+ * coroutine is released, its Cleanup function is called.
+ *
+ * @param [in] co the coroutine
+ * @param [in] result value returned to the coroutine by coroutine_yield()
+ * @return status code
+ */
+int coroutine_resume(CoroutineT *co, int result)
+{
+    if (co == NULL || co->running || co->finished)
+    {
+        return ERR_COROUTINE_UNKNOWN;
+    }
+
+    co->result = result;
+    co->caller = coroutine_current;
+    co->running = 1;
+    coroutine_current = co;
+    swapcontext(&co->callerCtx, &co->ctx);
+    coroutine_current = co->caller;
+    co->running = 0;
+
+    if (co->finished)
+    {
+        // We are off its stack now, it can go
+        if (co->cleanUp) (*co->cleanUp)(co->clientData);
+        CoroutineFree(co);
+    }
+
+    return ERR_COROUTINE_OK;
+}
+
+/**
+ * @brief Suspend the running coroutine for a while
+ *
+ * @param [in] msec delay time in millisecond
+ * @return status code, ERR_COROUTINE_CANCELLED if the scheduler is closing
+ */
+int coroutine_sleep(unsigned int msec)
+{
+    CoroutineT *co = coroutine_current;
+
+    if (co == NULL)
+    {
+        return ERR_COROUTINE_NOT_IN_COROUTINE;
+    }
+
+    co->waitResult = ERR_COROUTINE_CANCELLED;
+    co->waitTask = scheduler_delay_task(co->scheduler, msec, DELAYTASK_FLAG_ONESHOT, \
+                                        (SchedProcT)CoroutineTimerFire, co, (SchedProcT)CoroutineWaitRelease);
+    if (co->waitTask == SCHED_TASK_ID_INVALID)
+    {
+        return ERR_COROUTINE_UNKNOWN;
+    }
+    co->waitArmed = 1;
+
+    return coroutine_yield();
+}
+
+/**
+ * @brief Suspend the running coroutine until a socket becomes readable
+ * The socket must not be handled by anybody else in the scheduler.
+ *
+ * @param [in] sock the socket descriptor
+ * @param [in] msec max time to wait in millisecond, 0 to wait forever
+ * @return status code, ERR_COROUTINE_TIMEOUT or ERR_COROUTINE_CANCELLED if it didn't become readable
+ */
+int coroutine_wait_read(int sock, unsigned int msec)
+{
+    CoroutineT *co = coroutine_current;
+
+    if (co == NULL)
+    {
+        return ERR_COROUTINE_NOT_IN_COROUTINE;
+    }
+
+    co->waitResult = ERR_COROUTINE_CANCELLED;
+    if (scheduler_handle_read(co->scheduler, sock, (SchedProcT)CoroutineReadFire, co, \
+                              (SchedProcT)CoroutineWaitRelease) != ERR_SCHEDULER_OK)
+    {
+        return ERR_COROUTINE_UNKNOWN;
+    }
+    co->waitSock = sock;
+    co->waitArmed = 1;
+
+    if (msec > 0)
+    {
+        co->waitTask = scheduler_delay_task(co->scheduler, msec, DELAYTASK_FLAG_ONESHOT, \
+                                            (SchedProcT)CoroutineTimerFire, co, (SchedProcT)CoroutineWaitRelease);
+        if (co->waitTask == SCHED_TASK_ID_INVALID)
+        {
+            // We are running, releasing the read handler doesn't resume us
+            co->waitSock = -1;
+            scheduler_unhandle_read(co->scheduler, sock);
+            return ERR_COROUTINE_UNKNOWN;
+        }
+        co->waitArmed++;
+    }
+
+    return coroutine_yield();
+}
+
+static void CoroutineEntry(void)
+{
+    CoroutineT *co = coroutine_current;
+
+    if (co->proc) (*co->proc)(co->clientData);
+    co->finished = 1;
+    // Returning goes to "uc_link", the context of the last coroutine_resume()
+}
+
+static void CoroutineFree(CoroutineT *co)
+{
+    munmap(co->stack, co->stackSize);
+    FREE(co);
+}
+
+static void CoroutineTimerFire(CoroutineT *co)
+{
+    int sock = co->waitSock;
+
+    co->waitTask = SCHED_TASK_ID_INVALID;
+    co->waitResult = (sock >= 0) ? ERR_COROUTINE_TIMEOUT : ERR_COROUTINE_OK;
+    if (sock >= 0)
+    {
+        co->waitSock = -1;
+        scheduler_unhandle_read(co->scheduler, sock);
+    }
+    // The scheduler releases the task right after, that resumes us
+}
+
+static void CoroutineReadFire(CoroutineT *co)
+{
+    SchedTaskIdT task = co->waitTask;
+    int sock = co->waitSock;
+
+    co->waitResult = ERR_COROUTINE_OK;
+    if (task != SCHED_TASK_ID_INVALID)
+    {
+        co->waitTask = SCHED_TASK_ID_INVALID;
+        scheduler_undelay_task(co->scheduler, task);
+    }
+    co->waitSock = -1;
+    scheduler_unhandle_read(co->scheduler, sock);
+}
+
+// Cleanup function of the timer and of the read handler
+static void CoroutineWaitRelease(CoroutineT *co)
+{
+    if (--co->waitArmed > 0 || co->running)
+    {
+        return;
+    }
+    co->waitSock = -1;
+    co->waitTask = SCHED_TASK_ID_INVALID;
+    coroutine_resume(co, co->waitResult);
+}
+
+#else
+
+// No ucontext on this platform, callers run the functions themselves
+int coroutine_start(SchedulerT *scheduler, unsigned int stackSize, SchedProcT proc, void *clientData, SchedProcT cleanUp)
+{
+    return ERR_COROUTINE_UNSUPPORTED;
+}
+
+CoroutineT* coroutine_self(void)
+{
+    return NULL;
+}
+
+int coroutine_yield(void)
+{
+    return ERR_COROUTINE_NOT_IN_COROUTINE;
+}
+
+int coroutine_resume(CoroutineT *co, int result)
+{
+    return ERR_COROUTINE_UNSUPPORTED;
+}
+
+int coroutine_sleep(unsigned int msec)
+{
+    return ERR_COROUTINE_NOT_IN_COROUTINE;
+}
+
+int coroutine_wait_read(int sock, unsigned int msec)
+{
+    return ERR_COROUTINE_NOT_IN_COROUTINE;
+}
+
+#endif // LINUX_ENV
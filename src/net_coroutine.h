@@ -0,0 +1,37 @@
+
+#ifndef __NET_COROUTINE_H__
+#define __NET_COROUTINE_H__
+
+#include "net_scheduler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COROUTINE_STACK_SIZE    (64*1024) // unless coroutine_start() is given another size
+
+typedef struct _CoroutineT CoroutineT;
+
+// Coroutine Interfaces, a coroutine runs on the thread of its scheduler:
+int coroutine_start(SchedulerT *scheduler, unsigned int stackSize, SchedProcT proc, void *clientData, SchedProcT cleanUp);
+CoroutineT* coroutine_self(void);
+int coroutine_yield(void);
+int coroutine_resume(CoroutineT *co, int result);
+
+// Suspend the calling coroutine until a scheduler event fires:
+int coroutine_sleep(unsigned int msec);
+int coroutine_wait_read(int sock, unsigned int msec);
+
+// Error code
+#define ERR_COROUTINE_OK		(0)
+#define ERR_COROUTINE_UNKNOWN		(-400)
+#define ERR_COROUTINE_UNSUPPORTED		(-401)
+#define ERR_COROUTINE_CANCELLED		(-402)
+#define ERR_COROUTINE_TIMEOUT		(-403)
+#define ERR_COROUTINE_NOT_IN_COROUTINE		(-404)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __NET_COROUTINE_H__
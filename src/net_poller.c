@@ -0,0 +1,409 @@
+
+#include "net_poller.h"
+
+#if defined(LINUX_ENV)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <sys/time.h>
+#define POLLER_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#define closesocket	close
+#elif defined(PLATFORM_RT_THREAD)
+#include <rtthread.h>
+#include <lwip/sockets.h>
+#define POLLER_PRINTF rt_kprintf
+#define MALLOC UT_MALLOC
+#define FREE UT_FREE
+#define MEMSET UT_MEMSET
+#endif
+
+typedef struct _PollerOpsT
+{
+    const char *name;
+    int (*open)(PollerT *poller);
+    void (*close)(PollerT *poller);
+    int (*ctl)(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents);
+    int (*wait)(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec);
+} PollerOpsT;
+
+typedef struct _SelectPollerT
+{
+    int maxNumSocks;
+    int nextSock; // the next scan starts here, so the high sockets get their turn when there are more than maxEvents
+    fd_set readSet;
+    fd_set writeSet;
+} SelectPollerT;
+
+#if defined(LINUX_ENV)
+typedef struct _EpollPollerT
+{
+    int epfd;
+    int noPwait2; // bool var, the kernel has no epoll_pwait2(), wait in milliseconds
+    int numEvents;
+    struct epoll_event *events;
+} EpollPollerT;
+#endif
+
+struct _PollerT
+{
+    PollerTypeE type;
+    const PollerOpsT *ops;
+    union
+    {
+        SelectPollerT select;
+#if defined(LINUX_ENV)
+        EpollPollerT epoll;
+#endif
+    } u;
+};
+
+static int SelectOpen(PollerT *poller);
+static void SelectClose(PollerT *poller);
+static int SelectCtl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents);
+static int SelectWait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec);
+#if defined(LINUX_ENV)
+static int EpollOpen(PollerT *poller);
+static void EpollClose(PollerT *poller);
+static int EpollCtl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents);
+static int EpollWait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec);
+#endif
+
+static const PollerOpsT select_ops =
+{
+    "select", SelectOpen, SelectClose, SelectCtl, SelectWait
+};
+
+#if defined(LINUX_ENV)
+static const PollerOpsT epoll_ops =
+{
+    "epoll", EpollOpen, EpollClose, EpollCtl, EpollWait
+};
+#endif
+
+/**
+ * @brief Create a poller
+ * If the requested backend is not available on this platform, or it fails to
+ * initialize, the select() backend is used instead.
+ *
+ * @param [out] pPoller get a poller
+ * @param [in] type the backend we want
+ * @return status code
+ */
+int poller_open(PollerT **pPoller, PollerTypeE type)
+{
+    PollerT *poller;
+    int ret;
+
+    poller = (PollerT *)MALLOC(sizeof(PollerT));
+    if (poller == NULL)
+    {
+        return ERR_POLLER_UNKNOWN;
+    }
+    MEMSET(poller, 0, sizeof(PollerT));
+
+    switch (type)
+    {
+#if defined(LINUX_ENV)
+        case POLLER_TYPE_DEFAULT:
+        case POLLER_TYPE_EPOLL:
+            poller->type = POLLER_TYPE_EPOLL;
+            poller->ops = &epoll_ops;
+            break;
+#endif
+        default:
+            poller->type = POLLER_TYPE_SELECT;
+            poller->ops = &select_ops;
+            break;
+    }
+
+    ret = poller->ops->open(poller);
+    if (ret != ERR_POLLER_OK && poller->type != POLLER_TYPE_SELECT)
+    {
+        POLLER_PRINTF("[Poller] %s backend unavailable, fall back to select\n", poller->ops->name);
+        MEMSET(poller, 0, sizeof(PollerT));
+        poller->type = POLLER_TYPE_SELECT;
+        poller->ops = &select_ops;
+        ret = poller->ops->open(poller);
+    }
+    if (ret != ERR_POLLER_OK)
+    {
+        FREE(poller);
+        return ret;
+    }
+
+    *pPoller = poller;
+    return ERR_POLLER_OK;
+}
+
+/**
+ * @brief Destroy a poller
+ *
+ * @param [in, out] pPoller [in] a poller get from poller_open(), [out] should be set to NULL if succeed
+ * @return status code
+ */
+int poller_close(PollerT **pPoller)
+{
+    PollerT *poller = *pPoller;
+
+    poller->ops->close(poller);
+    FREE(poller);
+    *pPoller = NULL;
+
+    return ERR_POLLER_OK;
+}
+
+/**
+ * @brief Change the events we are interested in for a socket
+ * The caller keeps track of the current interest set, an oldEvents of 0 adds
+ * the socket, a newEvents of 0 removes it.
+ *
+ * @param [in] poller the poller get from poller_open()
+ * @param [in] sock the socket descriptor
+ * @param [in] oldEvents events currently registered, POLLER_EVENT_XXX
+ * @param [in] newEvents events we want from now on, POLLER_EVENT_XXX
+ * @return status code
+ */
+int poller_ctl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents)
+{
+    if (sock < 0) return ERR_POLLER_UNKNOWN;
+    if (oldEvents == newEvents) return ERR_POLLER_OK;
+
+    return poller->ops->ctl(poller, sock, oldEvents, newEvents);
+}
+
+/**
+ * @brief Wait for socket events
+ *
+ * @param [in] poller the poller get from poller_open()
+ * @param [out] events array receiving the ready sockets
+ * @param [in] maxEvents capacity of the events array
+ * @param [in] usec max time to wait in microsecond
+ * @return number of ready sockets, or a negative status code
+ */
+int poller_wait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec)
+{
+    if (maxEvents <= 0) return ERR_POLLER_UNKNOWN;
+
+    return poller->ops->wait(poller, events, maxEvents, usec);
+}
+
+PollerTypeE poller_type(PollerT *poller)
+{
+    return poller->type;
+}
+
+const char* poller_name(PollerT *poller)
+{
+    return poller->ops->name;
+}
+
+static int SelectOpen(PollerT *poller)
+{
+    SelectPollerT *sp = &poller->u.select;
+
+    sp->maxNumSocks = 0;
+    sp->nextSock = 0;
+    FD_ZERO(&sp->readSet);
+    FD_ZERO(&sp->writeSet);
+    return ERR_POLLER_OK;
+}
+
+static void SelectClose(PollerT *poller)
+{
+}
+
+static int SelectCtl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents)
+{
+    SelectPollerT *sp = &poller->u.select;
+
+    if (sock >= FD_SETSIZE)
+    {
+        POLLER_PRINTF("[Poller] socket %d exceeds FD_SETSIZE!\n", sock);
+        return ERR_POLLER_FD_RANGE;
+    }
+
+    if (newEvents & POLLER_EVENT_READ) FD_SET(sock, &sp->readSet);
+    else FD_CLR(sock, &sp->readSet);
+    if (newEvents & POLLER_EVENT_WRITE) FD_SET(sock, &sp->writeSet);
+    else FD_CLR(sock, &sp->writeSet);
+
+    if (newEvents && sock+1 > sp->maxNumSocks)
+    {
+        sp->maxNumSocks = sock + 1;
+    }
+    else if (!newEvents && sock+1 == sp->maxNumSocks)
+    {
+        // Shrink to the highest socket that is still registered
+        while (sp->maxNumSocks > 0 && \
+               !FD_ISSET(sp->maxNumSocks-1, &sp->readSet) && \
+               !FD_ISSET(sp->maxNumSocks-1, &sp->writeSet))
+        {
+            sp->maxNumSocks--;
+        }
+    }
+
+    return ERR_POLLER_OK;
+}
+
+static int SelectWait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec)
+{
+    SelectPollerT *sp = &poller->u.select;
+    struct timeval timeToDelay;
+    fd_set readSet, writeSet;
+    int ret, sock, start, i, num = 0;
+    unsigned int ev;
+
+    timeToDelay.tv_sec = usec/1000000;
+    timeToDelay.tv_usec = usec%1000000;
+
+    readSet = sp->readSet;
+    writeSet = sp->writeSet;
+    ret = select(sp->maxNumSocks, &readSet, &writeSet, NULL, &timeToDelay);
+    if (ret <= 0)
+    {
+        // Interrupted by a signal, nothing is ready
+        return (ret < 0 && errno == EINTR) ? 0 : ret;
+    }
+
+    // Go on from where the last scan stopped, wrapping around to socket 0
+    start = sp->nextSock < sp->maxNumSocks ? sp->nextSock : 0;
+    for (i = 0; i < sp->maxNumSocks && num < maxEvents; i++)
+    {
+        sock = start + i;
+        if (sock >= sp->maxNumSocks) sock -= sp->maxNumSocks;
+        ev = 0;
+        if (FD_ISSET(sock, &readSet)) ev |= POLLER_EVENT_READ;
+        if (FD_ISSET(sock, &writeSet)) ev |= POLLER_EVENT_WRITE;
+        if (ev)
+        {
+            events[num].sock = sock;
+            events[num].events = ev;
+            num++;
+        }
+    }
+    sp->nextSock = (start + i) % sp->maxNumSocks;
+
+    return num;
+}
+
+#if defined(LINUX_ENV)
+static int EpollOpen(PollerT *poller)
+{
+    EpollPollerT *ep = &poller->u.epoll;
+
+    ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->epfd < 0)
+    {
+        return ERR_POLLER_UNSUPPORTED;
+    }
+    ep->noPwait2 = 0;
+    ep->numEvents = 0;
+    ep->events = NULL;
+    return ERR_POLLER_OK;
+}
+
+static void EpollClose(PollerT *poller)
+{
+    EpollPollerT *ep = &poller->u.epoll;
+
+    closesocket(ep->epfd);
+    if (ep->events) FREE(ep->events);
+}
+
+static int EpollCtl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents)
+{
+    EpollPollerT *ep = &poller->u.epoll;
+    struct epoll_event ev;
+    int op, ret;
+
+    MEMSET(&ev, 0, sizeof(ev));
+    if (newEvents & POLLER_EVENT_READ) ev.events |= EPOLLIN;
+    if (newEvents & POLLER_EVENT_WRITE) ev.events |= EPOLLOUT;
+    ev.data.fd = sock;
+
+    if (oldEvents == 0) op = EPOLL_CTL_ADD;
+    else if (newEvents == 0) op = EPOLL_CTL_DEL;
+    else op = EPOLL_CTL_MOD;
+
+    ret = epoll_ctl(ep->epfd, op, sock, &ev);
+    if (ret < 0)
+    {
+        // The socket may be closed already, the kernel has dropped it for us
+        if (op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)) return ERR_POLLER_OK;
+        POLLER_PRINTF("[Poller] epoll_ctl(%d, %d) error! %d\n", op, sock, errno);
+        return ERR_POLLER_UNKNOWN;
+    }
+
+    return ERR_POLLER_OK;
+}
+
+static int EpollWait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec)
+{
+    EpollPollerT *ep = &poller->u.epoll;
+    struct epoll_event *newEvents;
+    int ret, i;
+    unsigned int ev;
+    unsigned long long msec;
+#if defined(__NR_epoll_pwait2)
+    struct timespec ts;
+#endif
+
+    if (maxEvents > ep->numEvents)
+    {
+        newEvents = (struct epoll_event *)MALLOC(maxEvents * sizeof(struct epoll_event));
+        if (newEvents == NULL) return ERR_POLLER_UNKNOWN;
+        if (ep->events) FREE(ep->events);
+        ep->events = newEvents;
+        ep->numEvents = maxEvents;
+    }
+
+    ret = -1;
+#if defined(__NR_epoll_pwait2)
+    if (!ep->noPwait2)
+    {
+        // epoll_pwait2() takes a timespec, so sub-millisecond timers are kept
+        ts.tv_sec = usec/1000000;
+        ts.tv_nsec = usec%1000000 * 1000;
+        ret = (int)syscall(__NR_epoll_pwait2, ep->epfd, ep->events, maxEvents, &ts, NULL, 0);
+        if (ret < 0 && errno == ENOSYS) ep->noPwait2 = 1;
+    }
+#else
+    ep->noPwait2 = 1;
+#endif
+    if (ep->noPwait2)
+    {
+        // Round up, waking up early would only make the scheduler spin
+        msec = (usec + 999) / 1000;
+        ret = epoll_wait(ep->epfd, ep->events, maxEvents, msec > INT_MAX ? INT_MAX : (int)msec);
+    }
+    if (ret < 0)
+    {
+        return (errno == EINTR) ? 0 : ret;
+    }
+
+    for (i = 0; i < ret; i++)
+    {
+        ev = 0;
+        if (ep->events[i].events & EPOLLIN) ev |= POLLER_EVENT_READ;
+        if (ep->events[i].events & EPOLLOUT) ev |= POLLER_EVENT_WRITE;
+        // Errors are reported through whatever the socket is waiting for,
+        // like select() does, so the handler will see them on its next call
+        if (ep->events[i].events & (EPOLLERR | EPOLLHUP)) ev |= POLLER_EVENT_READ | POLLER_EVENT_WRITE;
+        events[i].sock = ep->events[i].data.fd;
+        events[i].events = ev;
+    }
+
+    return ret;
+}
+#endif // LINUX_ENV
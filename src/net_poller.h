@@ -0,0 +1,46 @@
+
+#ifndef __NET_POLLER_H__
+#define __NET_POLLER_H__
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLLER_EVENT_READ       0x01
+#define POLLER_EVENT_WRITE      0x02
+
+typedef enum
+{
+    POLLER_TYPE_DEFAULT = 0, // best backend available on this platform
+    POLLER_TYPE_SELECT,
+    POLLER_TYPE_EPOLL,
+} PollerTypeE;
+
+typedef struct _PollerEventT
+{
+    int sock;
+    unsigned int events; // POLLER_EVENT_XXX
+} PollerEventT;
+
+typedef struct _PollerT PollerT;
+
+// Poller Interfaces:
+int poller_open(PollerT **pPoller, PollerTypeE type);
+int poller_close(PollerT **pPoller);
+int poller_ctl(PollerT *poller, int sock, unsigned int oldEvents, unsigned int newEvents);
+int poller_wait(PollerT *poller, PollerEventT *events, int maxEvents, unsigned long long usec);
+PollerTypeE poller_type(PollerT *poller);
+const char* poller_name(PollerT *poller);
+
+// Error code
+#define ERR_POLLER_OK		(0)
+#define ERR_POLLER_UNKNOWN		(-200)
+#define ERR_POLLER_UNSUPPORTED		(-201)
+#define ERR_POLLER_FD_RANGE		(-202)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __NET_POLLER_H__
@@ -0,0 +1,316 @@
+#include "net_pool.h"
+#include "net_list.h"
+
+#if defined(LINUX_ENV)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#define POOL_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(WIN32)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define POOL_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(PLATFORM_RT_THREAD)
+#include <rtthread.h>
+#define POOL_PRINTF rt_kprintf
+#define MALLOC UT_MALLOC
+#define FREE UT_FREE
+#define MEMSET UT_MEMSET
+#endif
+
+#define POOL_ALIGN 16 // objects are aligned like malloc() does
+#define POOL_ROUND(x) (((x) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+#define POOL_KEEP_EMPTY 1 // empty slabs kept for the next burst, the others go back at once
+
+typedef struct _PoolSlabT PoolSlabT;
+
+// Every object is preceded by the slab it belongs to, a free object holds
+// the next free one of its slab
+typedef union _PoolObjHeadT
+{
+    PoolSlabT *slab;
+    char pad[POOL_ALIGN];
+} PoolObjHeadT;
+
+struct _PoolSlabT
+{
+    ListNodeT listEntry; // in the partial, full or empty list of the pool
+    void *freeObj; // first free object
+    unsigned int usedNum;
+    unsigned int pad; // keeps the objects aligned
+};
+
+struct _PoolT
+{
+    // Objects are taken from the partial slabs first, so the empty ones
+    // stay empty and can be given back
+    ListNodeT partialList;
+    ListNodeT fullList;
+    ListNodeT emptyList;
+    unsigned int objSize;
+    unsigned int stride; // object and its header
+    unsigned int slabObjNum;
+    size_t slabSize;
+    PoolStatsT stats;
+};
+
+static PoolSlabT* NewSlab(PoolT *pool);
+static void DelSlab(PoolT *pool, PoolSlabT *slab);
+
+/**
+ * @brief Create a pool of objects of one size
+ *
+ * @param [out] pPool get a pool
+ * @param [in] objSize bytes of an object
+ * @return status code
+ */
+int pool_open(PoolT **pPool, unsigned int objSize)
+{
+    PoolT *pool;
+
+    if (objSize == 0) return ERR_POOL_UNKNOWN;
+
+    pool = (PoolT *)MALLOC(sizeof(PoolT));
+    if (pool == NULL)
+    {
+        return ERR_POOL_UNKNOWN;
+    }
+    MEMSET(pool, 0, sizeof(PoolT));
+    list_init(&pool->partialList);
+    list_init(&pool->fullList);
+    list_init(&pool->emptyList);
+    pool->objSize = objSize;
+    pool->stride = sizeof(PoolObjHeadT) + POOL_ROUND(objSize);
+    pool->slabObjNum = (POOL_SLAB_SIZE - POOL_ROUND(sizeof(PoolSlabT))) / pool->stride;
+    if (pool->slabObjNum == 0) pool->slabObjNum = 1;
+    pool->slabSize = POOL_ROUND(sizeof(PoolSlabT)) + (size_t)pool->slabObjNum * pool->stride;
+    pool->stats.objSize = objSize;
+    pool->stats.slabObjNum = pool->slabObjNum;
+
+    *pPool = pool;
+    return ERR_POOL_OK;
+}
+
+/**
+ * @brief Destroy a pool, the objects still in use are freed with it
+ *
+ * @param [in, out] pPool [in] a pool get from pool_open(), [out] set to NULL
+ * @return status code
+ */
+int pool_close(PoolT **pPool)
+{
+    PoolT *pool = *pPool;
+    PoolSlabT *slab;
+    ListNodeT *lists[3];
+    int i;
+
+    if (pool->stats.usedNum > 0)
+    {
+        POOL_PRINTF("[Pool] %u objects of %u bytes still in use!\n", pool->stats.usedNum, pool->objSize);
+    }
+    lists[0] = &pool->partialList;
+    lists[1] = &pool->fullList;
+    lists[2] = &pool->emptyList;
+    for (i = 0; i < 3; i++)
+    {
+        while (!list_isempty(lists[i]))
+        {
+            slab = list_entry(lists[i]->next, PoolSlabT, listEntry);
+            list_remove(&slab->listEntry);
+            DelSlab(pool, slab);
+        }
+    }
+    FREE(pool);
+    *pPool = NULL;
+
+    return ERR_POOL_OK;
+}
+
+/**
+ * @brief Get an object from the pool
+ *
+ * @param [in] pool the pool get from pool_open()
+ * @return the object, its content is undefined; NULL if out of memory
+ */
+void* pool_alloc(PoolT *pool)
+{
+    PoolSlabT *slab;
+    PoolObjHeadT *head;
+    void *obj;
+
+    if (!list_isempty(&pool->partialList))
+    {
+        slab = list_entry(pool->partialList.next, PoolSlabT, listEntry);
+    }
+    else if (!list_isempty(&pool->emptyList))
+    {
+        slab = list_entry(pool->emptyList.next, PoolSlabT, listEntry);
+        list_remove(&slab->listEntry);
+        list_insert_after(&pool->partialList, &slab->listEntry);
+        pool->stats.emptySlabNum--;
+    }
+    else
+    {
+        slab = NewSlab(pool);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        list_insert_after(&pool->partialList, &slab->listEntry);
+    }
+
+    obj = slab->freeObj;
+    slab->freeObj = *(void **)obj;
+    slab->usedNum++;
+    head = (PoolObjHeadT *)obj - 1;
+    head->slab = slab;
+    if (slab->usedNum == pool->slabObjNum)
+    {
+        list_remove(&slab->listEntry);
+        list_insert_after(&pool->fullList, &slab->listEntry);
+    }
+
+    pool->stats.allocNum++;
+    pool->stats.usedNum++;
+    if (pool->stats.usedNum > pool->stats.peakNum)
+    {
+        pool->stats.peakNum = pool->stats.usedNum;
+    }
+    return obj;
+}
+
+/**
+ * @brief Give an object back to its pool
+ * A slab left empty goes back to the system, unless it is the only empty one
+ *
+ * @param [in] pool the pool the object was get from
+ * @param [in] obj the object, NULL is ignored
+ */
+void pool_free(PoolT *pool, void *obj)
+{
+    PoolSlabT *slab;
+
+    if (obj == NULL) return;
+
+    slab = ((PoolObjHeadT *)obj - 1)->slab;
+    *(void **)obj = slab->freeObj;
+    slab->freeObj = obj;
+    if (slab->usedNum == pool->slabObjNum)
+    {
+        // Full slabs only come back to the partial list
+        list_remove(&slab->listEntry);
+        list_insert_after(&pool->partialList, &slab->listEntry);
+    }
+    slab->usedNum--;
+    pool->stats.usedNum--;
+
+    if (slab->usedNum == 0)
+    {
+        list_remove(&slab->listEntry);
+        if (pool->stats.emptySlabNum >= POOL_KEEP_EMPTY)
+        {
+            DelSlab(pool, slab);
+        }
+        else
+        {
+            list_insert_after(&pool->emptyList, &slab->listEntry);
+            pool->stats.emptySlabNum++;
+        }
+    }
+}
+
+/**
+ * @brief Give every empty slab back to the system
+ *
+ * @param [in] pool the pool get from pool_open()
+ * @return status code
+ */
+int pool_trim(PoolT *pool)
+{
+    PoolSlabT *slab;
+
+    while (!list_isempty(&pool->emptyList))
+    {
+        slab = list_entry(pool->emptyList.next, PoolSlabT, listEntry);
+        list_remove(&slab->listEntry);
+        DelSlab(pool, slab);
+        pool->stats.emptySlabNum--;
+    }
+
+    return ERR_POOL_OK;
+}
+
+/**
+ * @brief Get the usage of a pool
+ *
+ * @param [in] pool the pool get from pool_open()
+ * @param [out] stats the usage since pool_open()
+ * @return status code
+ */
+int pool_get_stats(PoolT *pool, PoolStatsT *stats)
+{
+    if (stats == NULL) return ERR_POOL_UNKNOWN;
+
+    *stats = pool->stats;
+    return ERR_POOL_OK;
+}
+
+// Take a slab from the system and chain its objects into its free list
+static PoolSlabT* NewSlab(PoolT *pool)
+{
+    PoolSlabT *slab;
+    char *obj;
+    unsigned int i;
+
+#if defined(LINUX_ENV)
+    // Slabs are mapped on their own so giving one back really unmaps it,
+    // instead of leaving a hole in the heap
+    slab = (PoolSlabT *)mmap(NULL, pool->slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+    {
+        return NULL;
+    }
+#else
+    slab = (PoolSlabT *)MALLOC(pool->slabSize);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+#endif
+
+    slab->usedNum = 0;
+    slab->freeObj = NULL;
+    obj = (char *)slab + POOL_ROUND(sizeof(PoolSlabT)) + sizeof(PoolObjHeadT);
+    for (i = pool->slabObjNum; i > 0; i--)
+    {
+        // Lowest address first in the free list
+        *(void **)(obj + (size_t)(i - 1) * pool->stride) = slab->freeObj;
+        slab->freeObj = obj + (size_t)(i - 1) * pool->stride;
+    }
+
+    pool->stats.slabNum++;
+    pool->stats.slabAllocNum++;
+    pool->stats.bytes += pool->slabSize;
+    return slab;
+}
+
+static void DelSlab(PoolT *pool, PoolSlabT *slab)
+{
+    pool->stats.slabNum--;
+    pool->stats.slabFreeNum++;
+    pool->stats.bytes -= pool->slabSize;
+#if defined(LINUX_ENV)
+    munmap(slab, pool->slabSize);
+#else
+    FREE(slab);
+#endif
+}
+
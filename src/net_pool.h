@@ -0,0 +1,46 @@
+#ifndef __NET_POOL_H__
+#define __NET_POOL_H__
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POOL_SLAB_SIZE      (64*1024) // bytes of a slab, unless it can't hold one object
+
+// A pool of fixed size objects carved out of slabs, not thread safe: each
+// reactor owns its pools and uses them on its own thread only
+typedef struct _PoolT PoolT;
+
+typedef struct _PoolStatsT
+{
+    unsigned int objSize; // bytes of an object
+    unsigned int slabObjNum; // objects per slab
+    unsigned int slabNum; // slabs held now
+    unsigned int emptySlabNum; // slabs held without any object in use
+    unsigned int usedNum; // objects in use
+    unsigned int peakNum; // max objects in use at once
+    unsigned long long allocNum; // pool_alloc() calls served
+    unsigned long long slabAllocNum; // slabs taken from the system
+    unsigned long long slabFreeNum; // slabs given back to the system
+    unsigned long long bytes; // memory held by the slabs
+} PoolStatsT;
+
+// Pool Interfaces:
+int pool_open(PoolT **pPool, unsigned int objSize);
+int pool_close(PoolT **pPool);
+void* pool_alloc(PoolT *pool);
+void pool_free(PoolT *pool, void *obj);
+int pool_trim(PoolT *pool);
+int pool_get_stats(PoolT *pool, PoolStatsT *stats);
+
+// Error code
+#define ERR_POOL_OK		(0)
+#define ERR_POOL_UNKNOWN		(-500)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __NET_POOL_H__
+
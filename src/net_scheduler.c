@@ -1,5 +1,4 @@
 #include "net_scheduler.h"
-#include "net_list.h"
 
 #if defined(LINUX_ENV)
 #include <stdio.h>
@@ -10,11 +9,14 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 #define SCHED_PRINTF printf
 #define MALLOC malloc
 #define FREE free
 #define MEMSET	memset
+#define MEMCPY	memcpy
 #define closesocket	close
 #elif defined(PLATFORM_RT_THREAD)
 #include <rtthread.h>
@@ -23,54 +25,42 @@
 #define MALLOC UT_MALLOC
 #define FREE UT_FREE
 #define MEMSET UT_MEMSET
+#define MEMCPY UT_MEMCPY
 #endif
 
+#define SCHEDULER_MAX_EVENTS 256 // Max events we take from the poller in one step
+
 typedef struct _DelayTaskT
 {
     SchedProcT proc;
     void *clientData;
     SchedProcT cleanUp;
-    unsigned int timeoutTick;
-    unsigned int msec;
+    unsigned long long timeoutTick; // microsecond, on the monotonic clock
+    unsigned long long period; // microsecond, for periodic tasks
     unsigned int flag;
-
-    // DelayTasks are linked together in a doubly-linked list:
-    ListNodeT listEntry;
+    unsigned int seq; // insertion order, keeps tasks with the same timeout FIFO
+    unsigned int gen; // bumped every time the slot is freed, so old ids stop matching
+    int slot; // index in the task slab
+    int nextFree; // free slots are chained together, -1 ends the list
+    int inUse; // bool var
+    int heapIndex; // position in the delay heap, -1 if not queued
+    int cancelled; // undelayed by its own proc, freed once the proc returns
+    int rearmed; // rescheduled by its own proc, queued again once the proc returns
 } DelayTaskT;
 
 typedef struct _HandlerDescriptorT
 {
-    int sock;
+    int sock; // -1 if this slot of the handler table is free
+    unsigned int events; // POLLER_EVENT_XXX we are waiting for
     SchedProcT handlerProc;
     void *clientData;
     SchedProcT cleanUp;
-
-    // Descriptors are linked together in a doubly-linked list:
-    ListNodeT listEntry;
+    SchedProcT writeProc;
+    void *writeData;
+    unsigned int addedStep; // step in which the socket was registered
+    int readSuspended; // bool var, the read Handler is kept but not called
 } HandlerDescriptorT;
 
-struct _SchedulerT
-{
-    ListNodeT delayQHead;
-    ListNodeT handlerQHead;
-
-    int lastHandledSock;
-    int maxNumSocks;
-    fd_set readSet;
-    int enableIPC; // bool var
-    unsigned short ipcPort; // host byte order
-};
-
-typedef struct _SchedIpcDataT
-{
-    unsigned int magicId;
-    SchedulerT *scheduler;
-    unsigned int msec;
-    SchedProcT task;
-    void *clientData;
-    SchedProcT cleanUp;
-} SchedIpcDataT;
-
 enum SchedIpcCmdE
 {
     SCHED_CMD_DELAY,
@@ -81,50 +71,126 @@ enum SchedIpcCmdE
 
 typedef struct _SchedIpcMsgT
 {
-    unsigned int magicId;
+    struct _SchedIpcMsgT *next;
     enum SchedIpcCmdE type;
-    int ret; // useless for now
-    void *param0;
-    void *param1;
-    void *param2;
-    void *param3;
-    void *param4;
-    void *param5;
-    void *param6;
+    int sock;
+    SchedTaskIdT taskId;
+    unsigned long long usec;
+    unsigned int flag;
+    SchedProcT proc;
+    void *clientData;
+    SchedProcT cleanUp;
 } SchedIpcMsgT;
 
 
-#define SCHEDULER_TICK_MAX 0xffffffff // Maxium number of UINT32
-#define SCHEDULER_IPC_MSG_MAGIC_ID 0x01DADA10
+struct _SchedulerT
+{
+    // DelayTasks are kept in a binary min-heap ordered by timeoutTick
+    DelayTaskT **delayHeap;
+    int delayHeapSize;
+    int delayHeapCap;
+    // DelayTasks live in a slab made of fixed size chunks, so they never move
+    DelayTaskT **taskChunks;
+    int taskChunkNum;
+    int taskFreeSlot;
+    unsigned int taskSeq;
+    // Descriptors are stored in a table indexed by socket descriptor
+    HandlerDescriptorT *handlerTable;
+    int handlerTableCap;
+
+    unsigned long long now; // microsecond, read once per step
+    int inStep; // bool var, "now" is up to date while handlers and tasks run
 
-static unsigned int PlatformGetTick(void);
-static DelayTaskT* FindDelayTask(SchedulerT *scheduler, int token);
-static void AddDelayTask(SchedulerT *scheduler, DelayTaskT *task);
-static int HandleTimeout(SchedulerT *scheduler);
+    int lastHandledSock;
+    int dispatchBudget; // max handlers called in one step, 0 means no limit
+    unsigned int stepCount;
+    // Busy polling spins for "busyPollWindow" before blocking, the window
+    // follows the time between events and never exceeds "busyPollMax"
+    unsigned int busyPollMax;
+    unsigned int busyPollWindow;
+    unsigned long long lastEventTick;
+    SchedulerStatsT stats;
+    PollerT *poller;
+    PollerEventT events[SCHEDULER_MAX_EVENTS];
+    int enableIPC; // bool var
+
+    // IPC messages are posted by other threads into a lock-free
+    // multi-producer single-consumer queue, the wakeup descriptor
+    // makes the poller return when the queue is not empty
+    SchedIpcMsgT *ipcQHead; // producers push here
+    SchedIpcMsgT *ipcQTail; // the scheduler pops here
+    SchedIpcMsgT ipcStub;
+    int ipcWakePending;
+    int ipcWakeFd[2]; // eventfd, or the read/write ends of a pipe
+};
+
+#define SCHEDULER_TICK_MAX 0xffffffff // Maxium number of UINT32
+#define SCHEDULER_DELAY_MAX_US (SCHEDULER_TICK_MAX/2 * 1000ULL) // about 24 days
+#define SCHED_TASK_ID(task) (((SchedTaskIdT)(task)->gen << 32) | (SchedTaskIdT)((task)->slot + 1))
+#define SCHEDULER_DELAYQ_INIT_CAP 16
+#define SCHEDULER_TASK_CHUNK 64 // DelayTasks per chunk of the task slab
+#define SCHEDULER_HANDLER_INIT_CAP 64
+#define SCHEDULER_IPC_BUDGET 1024 // Max IPC messages handled in one step
+#define SCHEDULER_GAP_SHIFT 3 // the event gap average weighs a new sample 1/8
+
+static unsigned long long PlatformGetTime(void);
+static unsigned long long SchedulerGetTime(SchedulerT *scheduler);
+static int SchedulerWait(SchedulerT *scheduler, unsigned long long usec, unsigned long long start);
+static void AdaptBusyPoll(SchedulerT *scheduler);
+static DelayTaskT* FindDelayTask(SchedulerT *scheduler, SchedTaskIdT taskId);
+static DelayTaskT* AllocDelayTask(SchedulerT *scheduler);
+static void FreeDelayTask(SchedulerT *scheduler, DelayTaskT *task);
+static int AddDelayTask(SchedulerT *scheduler, DelayTaskT *task);
+static void RemoveDelayTask(SchedulerT *scheduler, DelayTaskT *task);
+static int TaskBefore(DelayTaskT *a, DelayTaskT *b);
+static void HeapSiftUp(SchedulerT *scheduler, int index);
+static void HeapSiftDown(SchedulerT *scheduler, int index);
+static void HeapFix(SchedulerT *scheduler, int index);
+static int HandleTimeout(SchedulerT *scheduler, unsigned long long currentTick);
 static HandlerDescriptorT* LookupHandler(SchedulerT *scheduler, int sock);
+static HandlerDescriptorT* AddHandler(SchedulerT *scheduler, int sock, unsigned int events);
+static int GrowHandlerTable(SchedulerT *scheduler, int sock);
+static int CompareEvent(const void *a, const void *b);
 static int AddIpcHandler(SchedulerT *scheduler);
+static void DelIpcHandler(SchedulerT *scheduler);
+static SchedIpcMsgT* NewIpcMsg(SchedulerT *scheduler, enum SchedIpcCmdE type);
+static int PostIpcMsg(SchedulerT *scheduler, SchedIpcMsgT *msg);
+static void PostIpcStub(SchedulerT *scheduler);
+static SchedIpcMsgT* PopIpcMsg(SchedulerT *scheduler);
+static void HandleIpcMsg(SchedulerT *scheduler, SchedIpcMsgT *msg);
 static void IpcHandler(void *data);
 
 
-// This function should return msec tick
-static unsigned int PlatformGetTick(void)
+// This function should return a monotonic time in microsecond
+static unsigned long long PlatformGetTime(void)
 {
 #if defined(WIN32)
-    return (unsigned int)GetTickCount();
+    return (unsigned long long)GetTickCount64() * 1000;
 #endif // WIN32
 
 #if defined(LINUX_ENV)
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    return tv.tv_sec*1000 + tv.tv_usec/1000;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
 #endif // LINUX_ENV
 
 #if defined(PLATFORM_RT_THREAD)
-    return (unsigned int)rt_tick_get()*10;
+    return (unsigned long long)rt_tick_get()*10000;
 #endif
 
 }
 
+// Handlers and tasks share the time read at the start of the step,
+// outside of a step the clock is read again
+static unsigned long long SchedulerGetTime(SchedulerT *scheduler)
+{
+    if (!scheduler->inStep)
+    {
+        scheduler->now = PlatformGetTime();
+    }
+    return scheduler->now;
+}
+
 /**
  * @brief Create a scheduler
  *
@@ -135,6 +201,7 @@ static unsigned int PlatformGetTick(void)
 int scheduler_open(SchedulerT **pScheduler, SchedulerParamT *param)
 {
     SchedulerT *scheduler;
+    PollerTypeE pollerType;
 
     scheduler = (SchedulerT *)MALLOC(sizeof(SchedulerT));
     if (scheduler == NULL)
@@ -142,23 +209,53 @@ int scheduler_open(SchedulerT **pScheduler, SchedulerParamT *param)
         return ERR_SCHEDULER_UNKNOWN;
     }
 
-    list_init(&scheduler->delayQHead);
-    list_init(&scheduler->handlerQHead);
-    scheduler->maxNumSocks = 0;
+    scheduler->delayHeap = NULL;
+    scheduler->delayHeapSize = 0;
+    scheduler->delayHeapCap = 0;
+    scheduler->taskChunks = NULL;
+    scheduler->taskChunkNum = 0;
+    scheduler->taskFreeSlot = -1;
+    scheduler->taskSeq = 0;
+    scheduler->handlerTable = NULL;
+    scheduler->handlerTableCap = 0;
     scheduler->lastHandledSock = -1;
-    FD_ZERO(&scheduler->readSet);
+    scheduler->dispatchBudget = 1;
+    scheduler->stepCount = 0;
+    scheduler->busyPollMax = 0;
+    scheduler->busyPollWindow = 0;
+    MEMSET(&scheduler->stats, 0, sizeof(SchedulerStatsT));
+    scheduler->now = PlatformGetTime();
+    scheduler->lastEventTick = scheduler->now;
+    scheduler->inStep = 0;
     scheduler->enableIPC = 0;
-    scheduler->ipcPort = 0;
+    scheduler->ipcWakeFd[0] = scheduler->ipcWakeFd[1] = -1;
+    pollerType = POLLER_TYPE_DEFAULT;
 
     if (param != NULL)
     {
         scheduler->enableIPC = param->enableIPC;
-        scheduler->ipcPort = param->ipcPort;
+        pollerType = param->pollerType;
+        scheduler->dispatchBudget = param->dispatchBudget;
+        scheduler->busyPollMax = param->busyPollUs;
+        scheduler->busyPollWindow = param->busyPollUs;
+    }
+
+    if (poller_open(&scheduler->poller, pollerType) != ERR_POLLER_OK)
+    {
+        FREE(scheduler);
+        return ERR_SCHEDULER_UNKNOWN;
     }
+    SCHED_PRINTF("[Scheduler] using %s poller\n", poller_name(scheduler->poller));
+
     if (scheduler->enableIPC)
     {
-        // use IPC Interface, add a socket for IPC handling
-        AddIpcHandler(scheduler);
+        // use IPC Interface, add a wakeup descriptor for IPC handling
+        if (AddIpcHandler(scheduler) != ERR_SCHEDULER_OK)
+        {
+            poller_close(&scheduler->poller);
+            FREE(scheduler);
+            return ERR_SCHEDULER_SOCKET;
+        }
     }
 
     *pScheduler = scheduler;
@@ -174,27 +271,41 @@ int scheduler_open(SchedulerT **pScheduler, SchedulerParamT *param)
  */
 int scheduler_close(SchedulerT **pScheduler)
 {
-    ListNodeT *entry;
-    HandlerDescriptorT *handler;
-    DelayTaskT *task;
+    int sock, i;
+    SchedIpcMsgT *msg;
     SchedulerT *scheduler = *pScheduler;
 
-    entry = scheduler->handlerQHead.next;
-    while (entry != &scheduler->handlerQHead)
+    if (scheduler->enableIPC)
     {
-        handler = list_entry(entry, HandlerDescriptorT, listEntry);
-        entry = entry->next;
-        scheduler_unhandle_read(scheduler, handler->sock);
+        // Carry out what other threads have posted, so every Cleanup function gets called
+        while ((msg = PopIpcMsg(scheduler)) != NULL)
+        {
+            HandleIpcMsg(scheduler, msg);
+        }
+        DelIpcHandler(scheduler);
     }
 
-    entry = scheduler->delayQHead.next;
-    while (entry != &scheduler->delayQHead)
+    for (sock = 0; sock < scheduler->handlerTableCap; sock++)
     {
-        task = list_entry(entry, DelayTaskT, listEntry);
-        entry = entry->next;
-        scheduler_undelay_task(scheduler, (int)task);
+        if (scheduler->handlerTable[sock].sock == sock)
+        {
+            scheduler_unhandle_read(scheduler, sock);
+        }
     }
 
+    while (scheduler->delayHeapSize > 0)
+    {
+        scheduler_undelay_task(scheduler, SCHED_TASK_ID(scheduler->delayHeap[0]));
+    }
+
+    poller_close(&scheduler->poller);
+    if (scheduler->delayHeap) FREE(scheduler->delayHeap);
+    for (i = 0; i < scheduler->taskChunkNum; i++)
+    {
+        FREE(scheduler->taskChunks[i]);
+    }
+    if (scheduler->taskChunks) FREE(scheduler->taskChunks);
+    if (scheduler->handlerTable) FREE(scheduler->handlerTable);
     FREE(scheduler);
     *pScheduler = NULL;
 
@@ -220,24 +331,10 @@ int scheduler_handle_read(SchedulerT *scheduler, int sock, \
 
     if (sock < 0) return ERR_SCHEDULER_UNKNOWN;
 
-    hd = LookupHandler(scheduler, sock);
+    hd = AddHandler(scheduler, sock, POLLER_EVENT_READ);
     if (hd == NULL)
     {
-        hd = (HandlerDescriptorT *)MALLOC(sizeof(HandlerDescriptorT));
-        if (hd == NULL)
-        {
-            return ERR_SCHEDULER_UNKNOWN;
-        }
-        hd->sock = sock;
-
-        // Link this descriptor into a doubly-linked list:
-        list_insert_before(&scheduler->handlerQHead, &hd->listEntry);
-
-        FD_SET(sock, &scheduler->readSet);
-        if (sock+1 > scheduler->maxNumSocks)
-        {
-            scheduler->maxNumSocks = sock + 1;
-        }
+        return ERR_SCHEDULER_SOCKET;
     }
     hd->handlerProc = handlerProc;
     hd->clientData = clientData;
@@ -249,6 +346,7 @@ int scheduler_handle_read(SchedulerT *scheduler, int sock, \
 
 /**
  * @brief Delete a socket read event Handler from the scheduler
+ * The socket is removed from the scheduler, its write event Handler too
  *
  * @param [in] scheduler the scheduler get from scheduler_open()
  * @param [in] sock the socket descriptor we want to delete
@@ -257,6 +355,8 @@ int scheduler_handle_read(SchedulerT *scheduler, int sock, \
 int scheduler_unhandle_read(SchedulerT *scheduler, int sock)
 {
     HandlerDescriptorT *hd;
+    SchedProcT cleanUp;
+    void *clientData;
 
     hd = LookupHandler(scheduler, sock);
     if (hd == NULL)
@@ -264,105 +364,314 @@ int scheduler_unhandle_read(SchedulerT *scheduler, int sock)
         return ERR_SCHEDULER_DESCRIPTOR_NOT_FOUND;
     }
 
-    list_remove(&hd->listEntry);
+    // remove from the poller
+    poller_ctl(scheduler->poller, sock, hd->events, 0);
 
-    // remove from socket set
-    FD_CLR(sock, &scheduler->readSet);
-    if (sock+1 == scheduler->maxNumSocks)
+    // Release the slot first, the Cleanup function may register the socket again
+    cleanUp = hd->cleanUp;
+    clientData = hd->clientData;
+    hd->sock = -1;
+    if (cleanUp != NULL)
     {
-        scheduler->maxNumSocks--;
+        cleanUp(clientData);
     }
 
-    if (hd->cleanUp != NULL)
+    return ERR_SCHEDULER_OK;
+
+}
+
+/**
+ * @brief Add a socket write event Handler into the scheduler
+ * When the socket becomes writable, the Handler function will be called. Keep it only
+ * as long as there is pending output, or it will be called in every step.
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor
+ * @param [in] handlerProc the Handler function
+ * @param [in] clientData specific data passed to Handler function
+ * @return status code
+ */
+int scheduler_handle_write(SchedulerT *scheduler, int sock, SchedProcT handlerProc, void *clientData)
+{
+    HandlerDescriptorT *hd;
+
+    if (sock < 0) return ERR_SCHEDULER_UNKNOWN;
+
+    hd = AddHandler(scheduler, sock, POLLER_EVENT_WRITE);
+    if (hd == NULL)
     {
-        hd->cleanUp(hd->clientData);
+        return ERR_SCHEDULER_SOCKET;
     }
-    FREE(hd);
+    hd->writeProc = handlerProc;
+    hd->writeData = clientData;
 
     return ERR_SCHEDULER_OK;
 
 }
 
+/**
+ * @brief Delete a socket write event Handler from the scheduler
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor
+ * @return status code
+ */
+int scheduler_unhandle_write(SchedulerT *scheduler, int sock)
+{
+    HandlerDescriptorT *hd;
+    unsigned int events;
+
+    hd = LookupHandler(scheduler, sock);
+    if (hd == NULL || !(hd->events & POLLER_EVENT_WRITE))
+    {
+        return ERR_SCHEDULER_DESCRIPTOR_NOT_FOUND;
+    }
+
+    events = hd->events & ~POLLER_EVENT_WRITE;
+    poller_ctl(scheduler->poller, sock, hd->events, events);
+    hd->events = events;
+    hd->writeProc = NULL;
+    hd->writeData = NULL;
+    if (events == 0 && !hd->readSuspended)
+    {
+        // Nobody reads this socket, release the slot
+        hd->sock = -1;
+    }
+
+    return ERR_SCHEDULER_OK;
+
+}
+
+/**
+ * @brief Stop waiting for the read event of a socket, keeping its read event Handler
+ * The socket stays in the scheduler until scheduler_unhandle_read(), e.g. while a
+ * request of the peer is being served elsewhere.
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor
+ * @return status code
+ */
+int scheduler_suspend_read(SchedulerT *scheduler, int sock)
+{
+    HandlerDescriptorT *hd;
+    unsigned int events;
+
+    hd = LookupHandler(scheduler, sock);
+    if (hd == NULL || (!(hd->events & POLLER_EVENT_READ) && !hd->readSuspended))
+    {
+        return ERR_SCHEDULER_DESCRIPTOR_NOT_FOUND;
+    }
+    if (hd->readSuspended)
+    {
+        return ERR_SCHEDULER_OK;
+    }
+
+    events = hd->events & ~POLLER_EVENT_READ;
+    if (poller_ctl(scheduler->poller, sock, hd->events, events) != ERR_POLLER_OK)
+    {
+        return ERR_SCHEDULER_SOCKET;
+    }
+    hd->events = events;
+    hd->readSuspended = 1;
+
+    return ERR_SCHEDULER_OK;
+}
+
+/**
+ * @brief Wait for the read event of a socket again after scheduler_suspend_read()
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor
+ * @return status code
+ */
+int scheduler_resume_read(SchedulerT *scheduler, int sock)
+{
+    HandlerDescriptorT *hd;
+
+    hd = LookupHandler(scheduler, sock);
+    if (hd == NULL)
+    {
+        return ERR_SCHEDULER_DESCRIPTOR_NOT_FOUND;
+    }
+    if (!hd->readSuspended)
+    {
+        return ERR_SCHEDULER_OK;
+    }
+
+    if (poller_ctl(scheduler->poller, sock, hd->events, hd->events | POLLER_EVENT_READ) != ERR_POLLER_OK)
+    {
+        return ERR_SCHEDULER_SOCKET;
+    }
+    hd->events |= POLLER_EVENT_READ;
+    hd->readSuspended = 0;
+
+    return ERR_SCHEDULER_OK;
+}
+
 /**
  * @brief Add a Task into the scheduler that will be executed in specified delay time
  *
  * @param [in] scheduler the scheduler get from scheduler_open()
- * @param [in] msec delay time in microsecond
+ * @param [in] msec delay time in millisecond
  * @param [in] proc the delayed Task function
  * @param [in] clientData specific data passed to the Task function and Cleanup function
  * @param [in] cleanUp the Cleanup function for doing cleanup job
- * @return a unique token number identifying the delayed Task
+ * @return the id of the delayed Task, SCHED_TASK_ID_INVALID if failed
  */
-int scheduler_delay_task(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp)
+SchedTaskIdT scheduler_delay_task(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp)
+{
+    return scheduler_delay_task_us(scheduler, (unsigned long long)msec * 1000, flag, proc, clientData, cleanUp);
+}
+
+/**
+ * @brief Same as scheduler_delay_task() but the delay time is in microsecond
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] usec delay time in microsecond
+ * @param [in] proc the delayed Task function
+ * @param [in] clientData specific data passed to the Task function and Cleanup function
+ * @param [in] cleanUp the Cleanup function for doing cleanup job
+ * @return the id of the delayed Task, SCHED_TASK_ID_INVALID if failed
+ */
+SchedTaskIdT scheduler_delay_task_us(SchedulerT *scheduler, unsigned long long usec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp)
 {
     DelayTaskT *task;
 
-    if (msec > SCHEDULER_TICK_MAX/2)
+    if (usec > SCHEDULER_DELAY_MAX_US)
     {
-        return ERR_SCHEDULER_UNKNOWN;
+        return SCHED_TASK_ID_INVALID;
     }
 
     // Make up a DelayTask
-    task = (DelayTaskT *)MALLOC(sizeof(DelayTaskT));
+    task = AllocDelayTask(scheduler);
     if (task == NULL)
     {
-        return ERR_SCHEDULER_UNKNOWN;
+        return SCHED_TASK_ID_INVALID;
     }
     
     task->proc = proc;
     task->clientData = clientData;
     task->cleanUp = cleanUp;
-    task->timeoutTick = PlatformGetTick() + msec;
-    task->msec = msec;
+    task->timeoutTick = SchedulerGetTime(scheduler) + usec;
+    task->period = usec;
     task->flag = flag;
 
     // Add task to the queue
-    AddDelayTask(scheduler, task);
-    return (int)task;
+    if (AddDelayTask(scheduler, task) != ERR_SCHEDULER_OK)
+    {
+        FreeDelayTask(scheduler, task);
+        return SCHED_TASK_ID_INVALID;
+    }
+    return SCHED_TASK_ID(task);
 }
 
 /**
  * @brief Delete a delayed Task from the scheduler
  *
  * @param [in] scheduler the scheduler get from scheduler_open()
- * @param [in] token the token number identifying the delayed Task
- * @return remain time
+ * @param [in] taskId the id of the delayed Task
+ * @return remain time in millisecond, rounded up
  */
-int scheduler_undelay_task(SchedulerT *scheduler, int token)
+int scheduler_undelay_task(SchedulerT *scheduler, SchedTaskIdT taskId)
 {
     DelayTaskT *task;
-    unsigned int remainTick;
+    unsigned long long now;
+    int remainTick;
+    SchedProcT cleanUp;
+    void *clientData;
 
-    task = FindDelayTask(scheduler, token);
-    if (task != NULL)
+    task = FindDelayTask(scheduler, taskId);
+    if (task != NULL && !task->cancelled)
     {
-        remainTick = PlatformGetTick();
-        if (remainTick >= task->timeoutTick)
+        now = SchedulerGetTime(scheduler);
+        if (now >= task->timeoutTick)
         {
             remainTick = 0;
         }
         else
         {
-            remainTick = task->timeoutTick - remainTick;
+            remainTick = (int)((task->timeoutTick - now + 999) / 1000);
         }
         
-        list_remove(&task->listEntry);
-        if (task->cleanUp != NULL)
+        if (task->heapIndex < 0)
+        {
+            // The task is running right now, HandleTimeout() will release it
+            task->cancelled = 1;
+            return remainTick;
+        }
+
+        RemoveDelayTask(scheduler, task);
+        cleanUp = task->cleanUp;
+        clientData = task->clientData;
+        FreeDelayTask(scheduler, task);
+        if (cleanUp != NULL)
         {
-            (*task->cleanUp)(task->clientData);
+            (*cleanUp)(clientData);
         }
-        FREE(task);
-        return (int)remainTick;
+        return remainTick;
     }
 
     return ERR_SCHEDULER_TASK_NOT_FOUND;
 }
 
+/**
+ * @brief Move a delayed Task to a new timeout, counted from now
+ * A periodic Task keeps its period once it has run. Cheaper than undelaying
+ * and adding the Task again, e.g. for an idle timer reset on every request.
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] taskId the id of the delayed Task
+ * @param [in] msec new delay time in millisecond
+ * @return status code
+ */
+int scheduler_reschedule_task(SchedulerT *scheduler, SchedTaskIdT taskId, unsigned int msec)
+{
+    return scheduler_reschedule_task_us(scheduler, taskId, (unsigned long long)msec * 1000);
+}
+
+/**
+ * @brief Same as scheduler_reschedule_task() but the delay time is in microsecond
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] taskId the id of the delayed Task
+ * @param [in] usec new delay time in microsecond
+ * @return status code
+ */
+int scheduler_reschedule_task_us(SchedulerT *scheduler, SchedTaskIdT taskId, unsigned long long usec)
+{
+    DelayTaskT *task;
+
+    if (usec > SCHEDULER_DELAY_MAX_US)
+    {
+        return ERR_SCHEDULER_UNKNOWN;
+    }
+
+    task = FindDelayTask(scheduler, taskId);
+    if (task == NULL || task->cancelled)
+    {
+        return ERR_SCHEDULER_TASK_NOT_FOUND;
+    }
+
+    task->timeoutTick = SchedulerGetTime(scheduler) + usec;
+    if (task->heapIndex < 0)
+    {
+        // The task is running right now, HandleTimeout() will queue it again
+        task->rearmed = 1;
+        return ERR_SCHEDULER_OK;
+    }
+
+    // A new seq keeps it behind the tasks already due at the same tick
+    task->seq = scheduler->taskSeq++;
+    HeapFix(scheduler, task->heapIndex);
+    return ERR_SCHEDULER_OK;
+}
+
 /**
  * @brief Same as scheduler_delay_task() interface but being used in IPC case
+ * It can be called from any thread, the Task is added by the scheduler thread.
  *
  * @param [in] scheduler the scheduler get from scheduler_open()
- * @param [in] msec delay time in microsecond
+ * @param [in] msec delay time in millisecond
  * @param [in] proc the delayed Task function
  * @param [in] clientData specific data passed to the Task function and Cleanup function
  * @param [in] cleanUp the Cleanup function for doing cleanup job
@@ -370,49 +679,98 @@ int scheduler_undelay_task(SchedulerT *scheduler, int token)
  */
 int scheduler_delay_task_remote(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp)
 {
-    int ret;
-    SchedIpcMsgT ipcMsg;
-    int sock;
-    struct sockaddr_in dest;
+    SchedIpcMsgT *msg;
 
-    if (scheduler && !scheduler->enableIPC)   // this scheduler doesn't enable IPC Interface
+    msg = NewIpcMsg(scheduler, SCHED_CMD_DELAY);
+    if (msg == NULL)
     {
         return ERR_SCHEDULER_UNKNOWN;
     }
+    msg->usec = (unsigned long long)msec * 1000;
+    msg->flag = flag;
+    msg->proc = proc;
+    msg->clientData = clientData;
+    msg->cleanUp = cleanUp;
 
-    ipcMsg.magicId = SCHEDULER_IPC_MSG_MAGIC_ID;
-    ipcMsg.type = SCHED_CMD_DELAY;
-    ipcMsg.param0 = (void*)scheduler;
-    ipcMsg.param1 = (void*)msec;
-    ipcMsg.param2 = (void*)flag;
-    ipcMsg.param3 = (void*)proc;
-    ipcMsg.param4 = (void*)clientData;
-    ipcMsg.param5 = (void*)cleanUp;
+    return PostIpcMsg(scheduler, msg);
+}
 
-    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock < 0) return ERR_SCHEDULER_SOCKET;
+/**
+ * @brief Same as scheduler_undelay_task() interface but being used in IPC case
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] taskId the id of the delayed Task
+ * @return status code
+ */
+int scheduler_undelay_task_remote(SchedulerT *scheduler, SchedTaskIdT taskId)
+{
+    SchedIpcMsgT *msg;
 
-    MEMSET(&dest, 0, sizeof(dest));
-    dest.sin_family = AF_INET;
-    dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    dest.sin_port = htons(scheduler->ipcPort);
+    msg = NewIpcMsg(scheduler, SCHED_CMD_UNDELAY);
+    if (msg == NULL)
+    {
+        return ERR_SCHEDULER_UNKNOWN;
+    }
+    msg->taskId = taskId;
 
-    ret = sendto(sock, &ipcMsg, sizeof(ipcMsg), 0, (struct  sockaddr  *)&dest, sizeof(dest));
-    if (ret < 0)
+    return PostIpcMsg(scheduler, msg);
+}
+
+/**
+ * @brief Same as scheduler_handle_read() interface but being used in IPC case
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor
+ * @param [in] handlerProc the Handler function
+ * @param [in] clientData specific data passed to Handler function and Cleanup function
+ * @param [in] cleanUp the Cleanup function for doing cleanup job
+ * @return status code
+ */
+int scheduler_handle_read_remote(SchedulerT *scheduler, int sock, \
+                                 SchedProcT handlerProc, void *clientData, SchedProcT cleanUp)
+{
+    SchedIpcMsgT *msg;
+
+    msg = NewIpcMsg(scheduler, SCHED_CMD_HANDLE_READ);
+    if (msg == NULL)
     {
-        SCHED_PRINTF("[Scheduler] scheduler_delay_task_remote()->sendto() failed! %d\n", ret);
-        closesocket(sock);
-        return ERR_SCHEDULER_SOCKET;
+        return ERR_SCHEDULER_UNKNOWN;
     }
+    msg->sock = sock;
+    msg->proc = handlerProc;
+    msg->clientData = clientData;
+    msg->cleanUp = cleanUp;
 
-    closesocket(sock);
-    return ERR_SCHEDULER_OK;
+    return PostIpcMsg(scheduler, msg);
+}
+
+/**
+ * @brief Same as scheduler_unhandle_read() interface but being used in IPC case
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [in] sock the socket descriptor we want to delete
+ * @return status code
+ */
+int scheduler_unhandle_read_remote(SchedulerT *scheduler, int sock)
+{
+    SchedIpcMsgT *msg;
+
+    msg = NewIpcMsg(scheduler, SCHED_CMD_UNHANDLE_READ);
+    if (msg == NULL)
+    {
+        return ERR_SCHEDULER_UNKNOWN;
+    }
+    msg->sock = sock;
+
+    return PostIpcMsg(scheduler, msg);
 }
 
 /**
  * @brief Single step of the scheduler
  * Currently we execute the scheduler in loop statements manually, probably change this
  * behaviour later
+ * One step waits for the poller once, then calls the Handler functions of up to
+ * "dispatchBudget" ready sockets and runs the DelayTasks that have come due.
  *
  * @param [in] scheduler the scheduler get from scheduler_open()
  * @param [in] defaultMsec default idle time interval
@@ -420,15 +778,14 @@ int scheduler_delay_task_remote(SchedulerT *scheduler, unsigned int msec, unsign
  */
 int scheduler_single_step(SchedulerT *scheduler, unsigned int defaultMsec)
 {
-    int ret;
-    ListNodeT *entry;
+    int ret, i, first, budget, handled, called;
     HandlerDescriptorT *hd;
+    PollerEventT *ev;
     DelayTaskT *task;
-    struct timeval timeToDelay;
-    unsigned int currentTick;
-    fd_set readSet;
+    unsigned long long timeToDelay;
+    unsigned long long currentTick;
 
-    // Very large "tv_sec" values cause select() to fail.
+    // Very large timeout values cause select() to fail.
     // Don't make it any larger than 1 million seconds (11.5 days)
     const unsigned int MAX_MSEC = 1000000000;
     if (defaultMsec > MAX_MSEC)
@@ -437,212 +794,535 @@ int scheduler_single_step(SchedulerT *scheduler, unsigned int defaultMsec)
         SCHED_PRINTF("[Scheduler] timeToDelay larger than 1 million seconds!\n");
     }
 
-    if (list_isempty(&scheduler->delayQHead))
+    // The clock is read here, then again only if the poller blocks
+    currentTick = PlatformGetTime();
+    if (scheduler->delayHeapSize == 0)
     {
-        // Empty DelayTask queue, use default timeout value for select()
-        timeToDelay.tv_sec = defaultMsec/1000;
-        timeToDelay.tv_usec = defaultMsec%1000 *1000;
+        // Empty DelayTask queue, use default timeout value for the poller
+        timeToDelay = (unsigned long long)defaultMsec * 1000;
     }
     else
     {
-        entry = scheduler->delayQHead.next;
-        task = list_entry(entry, DelayTaskT, listEntry);
-        currentTick = PlatformGetTick();
-        // It supposes that task delay time should be less than the half duration of tick max
-        if (currentTick - task->timeoutTick < SCHEDULER_TICK_MAX/2)
+        task = scheduler->delayHeap[0];
+        if (currentTick >= task->timeoutTick)
         {
             // DelayTask have come due
-            timeToDelay.tv_sec = 0;
-            timeToDelay.tv_usec = 0;
+            timeToDelay = 0;
         }
         else
         {
             // DealyTask haven't come due, caculate timeout value
-            timeToDelay.tv_sec = (task->timeoutTick - currentTick)/1000;
-            timeToDelay.tv_usec = (task->timeoutTick - currentTick)%1000 * 1000;
+            timeToDelay = task->timeoutTick - currentTick;
         }
     }
 
-    readSet = scheduler->readSet;
-    ret = select(scheduler->maxNumSocks, &readSet, NULL, NULL, &timeToDelay);
+    ret = SchedulerWait(scheduler, timeToDelay, currentTick);
     if (ret < 0)
     {
-        SCHED_PRINTF("[Scheduler] Socket select() error...\n");
+        SCHED_PRINTF("[Scheduler] Socket %s() error...\n", poller_name(scheduler->poller));
         return -1;
     }
 
-    // Call the handler function for one readable socket;
-    entry = scheduler->handlerQHead.next;
-    // To ensure forward progress through the handlers, begin past the last
-    // socket number that we handled:
-    if (scheduler->lastHandledSock >= 0)
+    // The time SchedulerWait() leaves serves all the handlers and DelayTasks of this step
+    scheduler->inStep = 1;
+    scheduler->stats.steps++;
+    if (ret > 0 && scheduler->busyPollMax > 0)
     {
-        hd = LookupHandler(scheduler, scheduler->lastHandledSock);
-        if (hd != NULL)
+        AdaptBusyPoll(scheduler);
+    }
+
+    // Call the handler functions for the ready sockets. To ensure forward
+    // progress through the handlers when more sockets are ready than the
+    // budget allows, serve them in ascending order beginning past the last
+    // socket number that we handled, and wrap around to the lowest one.
+    budget = scheduler->dispatchBudget;
+    if (budget <= 0 || budget > ret)
+    {
+        budget = ret;
+    }
+    first = 0;
+    if (budget < ret)
+    {
+        qsort(scheduler->events, ret, sizeof(PollerEventT), CompareEvent);
+        while (first < ret && scheduler->events[first].sock <= scheduler->lastHandledSock)
         {
-            entry = hd->listEntry.next;
+            first++;
         }
-        else
+        if (first == ret)
         {
-            scheduler->lastHandledSock = -1;
+            first = 0;
         }
     }
 
-    while (entry != &scheduler->handlerQHead)
+    scheduler->stepCount++;
+    handled = 0;
+    for (i = 0; i < ret && handled < budget; i++)
     {
-        hd = list_entry(entry, HandlerDescriptorT, listEntry);
-        if (FD_ISSET(hd->sock, &readSet) && hd->handlerProc != NULL)
+        ev = &scheduler->events[(first + i) % ret];
+        // An earlier handler may have closed this socket, or closed it and
+        // got the same socket number registered again, skip stale events
+        hd = LookupHandler(scheduler, ev->sock);
+        if (hd == NULL || hd->addedStep == scheduler->stepCount)
         {
-            scheduler->lastHandledSock = hd->sock;
-            // Note: we set "lastHandledSock" before calling the handler
-            (*hd->handlerProc)(hd->clientData);
-            break;
+            continue;
         }
-        entry = entry->next;
-    }
 
-    if (entry == &scheduler->handlerQHead && scheduler->lastHandledSock >= 0)
-    {
-        // We didn't call a handler, but we didn't get to check all of them,
-        // so try again from the beginning:
-        entry = scheduler->handlerQHead.next;
-        while (entry != &scheduler->handlerQHead )
+        called = 0;
+        if ((ev->events & hd->events & POLLER_EVENT_READ) && hd->handlerProc != NULL)
         {
-            hd = list_entry(entry, HandlerDescriptorT, listEntry);
-            if (FD_ISSET(hd->sock, &readSet) && hd->handlerProc != NULL)
+            scheduler->lastHandledSock = ev->sock;
+            // Note: we set "lastHandledSock" before calling the handler
+            (*hd->handlerProc)(hd->clientData);
+            called = 1;
+            // The read handler may have closed the socket as well
+            hd = LookupHandler(scheduler, ev->sock);
+            if (hd != NULL && hd->addedStep == scheduler->stepCount)
             {
-                scheduler->lastHandledSock = hd->sock;
-                // Note: we set "lastHandledSock" before calling the handler
-                (*hd->handlerProc)(hd->clientData);
-                break;
+                hd = NULL;
             }
-            entry = entry->next;
         }
+        if (hd != NULL && (ev->events & hd->events & POLLER_EVENT_WRITE) && hd->writeProc != NULL)
+        {
+            scheduler->lastHandledSock = ev->sock;
+            (*hd->writeProc)(hd->writeData);
+            called = 1;
+        }
+        handled += called;
     }
 
-    if (entry == &scheduler->handlerQHead)
+    if (handled == 0)
     {
         // We didn't call a handler
         scheduler->lastHandledSock = -1;
-        if (ret > 0)
-        {
-            // It should be impossible for the scheduler to run here
-            SCHED_PRINTF("[Scheduler] Scheduler have problem!\n");
-        }
     }
 
     // Also handle any DelayTask that may have come due.  (Note that we do this *after* calling a socket
     // handler, in case the DelayTask handler modifies the set of readable socket.)
-    HandleTimeout(scheduler);
+    HandleTimeout(scheduler, scheduler->now);
+    scheduler->inStep = 0;
 
     return ERR_SCHEDULER_OK;
 
 }
 
+/**
+ * @brief Get the time of the scheduler
+ * Inside of the Handler functions and Task functions it is the time the current
+ * step started, so every caller of one step sees the same value.
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @return monotonic time in microsecond
+ */
+unsigned long long scheduler_now(SchedulerT *scheduler)
+{
+    return SchedulerGetTime(scheduler);
+}
+
+/**
+ * @brief Get the counters of the scheduler
+ * Call it on the scheduler thread, from a Handler or a DelayTask for instance
+ *
+ * @param [in] scheduler the scheduler get from scheduler_open()
+ * @param [out] stats the counters since scheduler_open()
+ * @return status code
+ */
+int scheduler_get_stats(SchedulerT *scheduler, SchedulerStatsT *stats)
+{
+    if (stats == NULL) return ERR_SCHEDULER_UNKNOWN;
+
+    *stats = scheduler->stats;
+    stats->busyPollUs = scheduler->busyPollWindow;
+    return ERR_SCHEDULER_OK;
+}
+
+// Wait for events up to "usec", spinning on non-blocking polls first if busy
+// polling is on. An event coming in while we spin is picked up without the
+// wakeup latency of a blocking wait. "start" is the time the caller read
+// before, the time of the scheduler is set to it or to the time the wait
+// ended, the clock isn't read again unless we spin or block.
+static int SchedulerWait(SchedulerT *scheduler, unsigned long long usec, unsigned long long start)
+{
+    unsigned long long now, spinUntil;
+    int ret;
+
+    now = start;
+    if (scheduler->busyPollWindow > 0 && usec > 0)
+    {
+        spinUntil = start + (usec < scheduler->busyPollWindow ? usec : scheduler->busyPollWindow);
+        do
+        {
+            ret = poller_wait(scheduler->poller, scheduler->events, SCHEDULER_MAX_EVENTS, 0);
+            scheduler->stats.spinPolls++;
+            now = PlatformGetTime();
+        }
+        while (ret == 0 && now < spinUntil);
+        scheduler->stats.spinUs += now - start;
+        if (ret > 0)
+        {
+            scheduler->stats.spinHits++;
+        }
+        if (ret != 0 || now - start >= usec)
+        {
+            scheduler->now = now;
+            return ret;
+        }
+        usec -= now - start;
+    }
+
+    ret = poller_wait(scheduler->poller, scheduler->events, SCHEDULER_MAX_EVENTS, usec);
+    scheduler->now = now;
+    if (usec > 0)
+    {
+        scheduler->now = PlatformGetTime();
+        scheduler->stats.sleeps++;
+        scheduler->stats.sleepUs += scheduler->now - now;
+    }
+    return ret;
+}
+
+// Follow the smoothed time between the steps which got events: spinning for
+// about twice that catches most of the next ones. When the events come
+// further apart than the max window, spinning would mostly miss them, so
+// don't spin until they come closer again.
+static void AdaptBusyPoll(SchedulerT *scheduler)
+{
+    unsigned long long gap, avg;
+
+    gap = scheduler->now - scheduler->lastEventTick;
+    scheduler->lastEventTick = scheduler->now;
+    if (gap > SCHEDULER_TICK_MAX) gap = SCHEDULER_TICK_MAX;
+
+    avg = scheduler->stats.eventGapUs;
+    avg = (avg * ((1 << SCHEDULER_GAP_SHIFT) - 1) + gap) >> SCHEDULER_GAP_SHIFT;
+    scheduler->stats.eventGapUs = (unsigned int)avg;
+    if (avg > scheduler->busyPollMax)
+    {
+        scheduler->busyPollWindow = 0;
+    }
+    else
+    {
+        scheduler->busyPollWindow = (avg * 2 < scheduler->busyPollMax) ? (unsigned int)(avg * 2) : scheduler->busyPollMax;
+    }
+}
+
 static HandlerDescriptorT* LookupHandler(SchedulerT *scheduler, int sock)
 {
-    ListNodeT *entry;
-    HandlerDescriptorT *handler;
+    HandlerDescriptorT *hd;
+
+    if (sock < 0 || sock >= scheduler->handlerTableCap)
+    {
+        return NULL;
+    }
+
+    hd = &scheduler->handlerTable[sock];
+    return (hd->sock == sock) ? hd : NULL;
+
+}
+
+static int CompareEvent(const void *a, const void *b)
+{
+    return ((const PollerEventT *)a)->sock - ((const PollerEventT *)b)->sock;
+}
+
+// Get the descriptor of a socket, adding it if needed, and make sure
+// the poller waits for the given events on it
+static HandlerDescriptorT* AddHandler(SchedulerT *scheduler, int sock, unsigned int events)
+{
+    HandlerDescriptorT *hd;
 
-    entry = scheduler->handlerQHead.next;
-    while (entry != &scheduler->handlerQHead)
+    hd = LookupHandler(scheduler, sock);
+    if (hd == NULL)
+    {
+        if (sock >= scheduler->handlerTableCap && GrowHandlerTable(scheduler, sock) != ERR_SCHEDULER_OK)
+        {
+            return NULL;
+        }
+        if (poller_ctl(scheduler->poller, sock, 0, events) != ERR_POLLER_OK)
+        {
+            return NULL;
+        }
+        hd = &scheduler->handlerTable[sock];
+        MEMSET(hd, 0, sizeof(HandlerDescriptorT));
+        hd->sock = sock;
+        hd->events = events;
+        hd->addedStep = scheduler->stepCount;
+    }
+    else if ((hd->events & events) != events)
     {
-        handler = list_entry(entry, HandlerDescriptorT, listEntry);
-        if (handler->sock == sock)
+        if (poller_ctl(scheduler->poller, sock, hd->events, hd->events | events) != ERR_POLLER_OK)
         {
-            return handler;
+            return NULL;
         }
-        entry = entry->next;
+        hd->events |= events;
     }
 
-    return NULL;
+    return hd;
+}
+
+static int GrowHandlerTable(SchedulerT *scheduler, int sock)
+{
+    HandlerDescriptorT *table;
+    int i, cap;
+
+    cap = scheduler->handlerTableCap ? scheduler->handlerTableCap : SCHEDULER_HANDLER_INIT_CAP;
+    while (cap <= sock)
+    {
+        cap *= 2;
+    }
+
+    table = (HandlerDescriptorT *)MALLOC(cap * sizeof(HandlerDescriptorT));
+    if (table == NULL)
+    {
+        return ERR_SCHEDULER_UNKNOWN;
+    }
+    if (scheduler->handlerTable)
+    {
+        MEMCPY(table, scheduler->handlerTable, scheduler->handlerTableCap * sizeof(HandlerDescriptorT));
+        FREE(scheduler->handlerTable);
+    }
+    for (i = scheduler->handlerTableCap; i < cap; i++)
+    {
+        table[i].sock = -1;
+    }
+    scheduler->handlerTable = table;
+    scheduler->handlerTableCap = cap;
 
+    return ERR_SCHEDULER_OK;
 }
 
-static DelayTaskT* FindDelayTask(SchedulerT *scheduler, int token)
+static DelayTaskT* FindDelayTask(SchedulerT *scheduler, SchedTaskIdT taskId)
 {
-    ListNodeT *entry;
     DelayTaskT *task;
+    long long slot = (long long)(taskId & 0xffffffff) - 1;
+
+    if (slot < 0 || slot >= (long long)scheduler->taskChunkNum * SCHEDULER_TASK_CHUNK)
+    {
+        return NULL;
+    }
 
-    entry = scheduler->delayQHead.next;
-    while (entry != &scheduler->delayQHead)
+    task = &scheduler->taskChunks[slot / SCHEDULER_TASK_CHUNK][slot % SCHEDULER_TASK_CHUNK];
+    if (!task->inUse || task->gen != (unsigned int)(taskId >> 32))
     {
-        task = list_entry(entry, DelayTaskT, listEntry);
-        if ((int)task == token)
+        // The slot has been freed, and maybe reused, since this id was handed out
+        return NULL;
+    }
+    return task;
+}
+
+static DelayTaskT* AllocDelayTask(SchedulerT *scheduler)
+{
+    DelayTaskT **chunks, *chunk, *task;
+    int i, slot;
+
+    if (scheduler->taskFreeSlot < 0)
+    {
+        // No free slot left, add a chunk
+        chunks = (DelayTaskT **)MALLOC((scheduler->taskChunkNum + 1) * sizeof(DelayTaskT *));
+        if (chunks == NULL)
+        {
+            return NULL;
+        }
+        chunk = (DelayTaskT *)MALLOC(SCHEDULER_TASK_CHUNK * sizeof(DelayTaskT));
+        if (chunk == NULL)
         {
-            return task;
+            FREE(chunks);
+            return NULL;
         }
-        entry = entry->next;
+        if (scheduler->taskChunks)
+        {
+            MEMCPY(chunks, scheduler->taskChunks, scheduler->taskChunkNum * sizeof(DelayTaskT *));
+            FREE(scheduler->taskChunks);
+        }
+        for (i = SCHEDULER_TASK_CHUNK-1; i >= 0; i--)
+        {
+            MEMSET(&chunk[i], 0, sizeof(DelayTaskT));
+            chunk[i].slot = scheduler->taskChunkNum * SCHEDULER_TASK_CHUNK + i;
+            chunk[i].nextFree = scheduler->taskFreeSlot;
+            scheduler->taskFreeSlot = chunk[i].slot;
+        }
+        chunks[scheduler->taskChunkNum++] = chunk;
+        scheduler->taskChunks = chunks;
     }
 
-    return NULL;
+    slot = scheduler->taskFreeSlot;
+    task = &scheduler->taskChunks[slot / SCHEDULER_TASK_CHUNK][slot % SCHEDULER_TASK_CHUNK];
+    scheduler->taskFreeSlot = task->nextFree;
+    task->inUse = 1;
+    task->heapIndex = -1;
+    task->cancelled = 0;
+    task->rearmed = 0;
+    return task;
 }
 
-static void AddDelayTask(SchedulerT *scheduler, DelayTaskT *task)
+static void FreeDelayTask(SchedulerT *scheduler, DelayTaskT *task)
 {
-    ListNodeT *entry;
-    DelayTaskT *curTask;
-    
-    // Add task to the Delay List
-    entry = scheduler->delayQHead.next;
-    while (entry != &scheduler->delayQHead)
+    task->inUse = 0;
+    task->gen++;
+    task->nextFree = scheduler->taskFreeSlot;
+    scheduler->taskFreeSlot = task->slot;
+}
+
+// Return true if task "a" should run before task "b"
+static int TaskBefore(DelayTaskT *a, DelayTaskT *b)
+{
+    if (a->timeoutTick != b->timeoutTick)
+    {
+        return (a->timeoutTick < b->timeoutTick);
+    }
+    return (b->seq - a->seq < SCHEDULER_TICK_MAX/2);
+}
+
+static void HeapSiftUp(SchedulerT *scheduler, int index)
+{
+    DelayTaskT **heap = scheduler->delayHeap;
+    DelayTaskT *task = heap[index];
+    int parent;
+
+    while (index > 0)
     {
-        curTask = list_entry(entry, DelayTaskT, listEntry);
-        if (curTask->timeoutTick - task->timeoutTick != 0 && \
-            curTask->timeoutTick - task->timeoutTick < SCHEDULER_TICK_MAX/2)
+        parent = (index - 1) / 2;
+        if (!TaskBefore(task, heap[parent]))
         {
-            list_insert_before(entry, &task->listEntry);
             break;
         }
-        entry = entry->next;
+        heap[index] = heap[parent];
+        heap[index]->heapIndex = index;
+        index = parent;
     }
+    heap[index] = task;
+    task->heapIndex = index;
+}
 
-    // Insert into tail
-    if (entry == &scheduler->delayQHead)
+static void HeapSiftDown(SchedulerT *scheduler, int index)
+{
+    DelayTaskT **heap = scheduler->delayHeap;
+    DelayTaskT *task = heap[index];
+    int child;
+
+    while ((child = index*2 + 1) < scheduler->delayHeapSize)
     {
-        list_insert_before(entry, &task->listEntry);
+        if (child+1 < scheduler->delayHeapSize && TaskBefore(heap[child+1], heap[child]))
+        {
+            child++;
+        }
+        if (!TaskBefore(heap[child], task))
+        {
+            break;
+        }
+        heap[index] = heap[child];
+        heap[index]->heapIndex = index;
+        index = child;
     }
+    heap[index] = task;
+    task->heapIndex = index;
 }
 
-static int HandleTimeout(SchedulerT *scheduler)
+static int AddDelayTask(SchedulerT *scheduler, DelayTaskT *task)
+{
+    DelayTaskT **heap;
+    int cap;
+
+    if (scheduler->delayHeapSize == scheduler->delayHeapCap)
+    {
+        cap = scheduler->delayHeapCap ? scheduler->delayHeapCap*2 : SCHEDULER_DELAYQ_INIT_CAP;
+        heap = (DelayTaskT **)MALLOC(cap * sizeof(DelayTaskT *));
+        if (heap == NULL)
+        {
+            return ERR_SCHEDULER_UNKNOWN;
+        }
+        if (scheduler->delayHeap)
+        {
+            MEMCPY(heap, scheduler->delayHeap, scheduler->delayHeapSize * sizeof(DelayTaskT *));
+            FREE(scheduler->delayHeap);
+        }
+        scheduler->delayHeap = heap;
+        scheduler->delayHeapCap = cap;
+    }
+
+    task->seq = scheduler->taskSeq++;
+    scheduler->delayHeap[scheduler->delayHeapSize] = task;
+    HeapSiftUp(scheduler, scheduler->delayHeapSize++);
+    return ERR_SCHEDULER_OK;
+}
+
+static void RemoveDelayTask(SchedulerT *scheduler, DelayTaskT *task)
+{
+    int index = task->heapIndex;
+    DelayTaskT *last;
+
+    task->heapIndex = -1;
+    last = scheduler->delayHeap[--scheduler->delayHeapSize];
+    if (last == task)
+    {
+        return;
+    }
+
+    // Move the last task into the hole and restore the heap order
+    scheduler->delayHeap[index] = last;
+    last->heapIndex = index;
+    HeapFix(scheduler, index);
+}
+
+// The task at "index" has changed its position in the order, move it up or down
+static void HeapFix(SchedulerT *scheduler, int index)
+{
+    if (index > 0 && TaskBefore(scheduler->delayHeap[index], scheduler->delayHeap[(index-1)/2]))
+    {
+        HeapSiftUp(scheduler, index);
+    }
+    else
+    {
+        HeapSiftDown(scheduler, index);
+    }
+}
+
+static int HandleTimeout(SchedulerT *scheduler, unsigned long long currentTick)
 {
-    ListNodeT *entry;
     DelayTaskT *task;
-    unsigned currentTick;
+    unsigned int seqLimit;
+    SchedProcT cleanUp;
+    void *clientData;
 
-    if (list_isempty(&scheduler->delayQHead))
+    if (scheduler->delayHeapSize == 0)
     {
         return ERR_SCHEDULER_DELAYQ_EMPTY;
     }
 
-    entry = scheduler->delayQHead.next;
-    while (entry != &scheduler->delayQHead)
+    // Tasks queued while we are handling (including rescheduled periodic
+    // ones) get a newer seq and wait for the next step
+    seqLimit = scheduler->taskSeq;
+    while (scheduler->delayHeapSize > 0)
     {
-        task = list_entry(entry, DelayTaskT, listEntry);
-        entry = entry->next;
-        currentTick = PlatformGetTick();
-        // It supposes that task delay time should be less than the half duration of tick max
-        if (currentTick - task->timeoutTick < SCHEDULER_TICK_MAX/2)
+        task = scheduler->delayHeap[0];
+        if (currentTick < task->timeoutTick || \
+            seqLimit - task->seq - 1 >= SCHEDULER_TICK_MAX/2)
         {
-            // This DelayTask is due to be handled:
-            if (task->flag == DELAYTASK_FLAG_ONESHOT)
-            {
-                list_remove(&task->listEntry); // do this first, in case handler accesses queue
-                if (task->proc) (*task->proc)(task->clientData);
-                if (task->cleanUp) (*task->cleanUp)(task->clientData);
-                FREE(task);                
-            }
-            else
-            {
-                list_remove(&task->listEntry); // do this first, in case handler accesses queue
-                if (task->proc) (*task->proc)(task->clientData);
-                task->timeoutTick += task->msec;
-                AddDelayTask(scheduler, task);
-            }
+            break;
+        }
+
+        // This DelayTask is due to be handled:
+        RemoveDelayTask(scheduler, task); // do this first, in case handler accesses queue
+        if (task->proc) (*task->proc)(task->clientData);
+        if (task->cancelled || (task->flag == DELAYTASK_FLAG_ONESHOT && !task->rearmed))
+        {
+            cleanUp = task->cleanUp;
+            clientData = task->clientData;
+            FreeDelayTask(scheduler, task);
+            if (cleanUp) (*cleanUp)(clientData);
         }
         else
         {
-            break;
+            // A rescheduled task has got its timeoutTick already
+            if (!task->rearmed) task->timeoutTick += task->period;
+            task->rearmed = 0;
+            if (AddDelayTask(scheduler, task) != ERR_SCHEDULER_OK)
+            {
+                SCHED_PRINTF("[Scheduler] Periodic task dropped, out of memory!\n");
+                cleanUp = task->cleanUp;
+                clientData = task->clientData;
+                FreeDelayTask(scheduler, task);
+                if (cleanUp) (*cleanUp)(clientData);
+            }
         }
     }
 
@@ -652,92 +1332,206 @@ static int HandleTimeout(SchedulerT *scheduler)
 static int AddIpcHandler(SchedulerT *scheduler)
 {
     int ret;
-    int sock;
-    struct sockaddr_in addr;
-
-    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock < 0) return ERR_SCHEDULER_SOCKET;
 
-    MEMSET(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    addr.sin_port = htons(scheduler->ipcPort);
+    scheduler->ipcQHead = &scheduler->ipcStub;
+    scheduler->ipcQTail = &scheduler->ipcStub;
+    scheduler->ipcStub.next = NULL;
+    scheduler->ipcWakePending = 0;
 
-    ret = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
-    if (ret < 0)
+#if defined(LINUX_ENV)
+    scheduler->ipcWakeFd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    scheduler->ipcWakeFd[1] = scheduler->ipcWakeFd[0];
+    if (scheduler->ipcWakeFd[0] < 0)
     {
-        SCHED_PRINTF("[Scheduler] IpcHandler()->bind() error! %d\n", ret);
-        closesocket(sock);
+        SCHED_PRINTF("[Scheduler] AddIpcHandler()->eventfd() error!\n");
         return ERR_SCHEDULER_SOCKET;
     }
+#else
+    if (pipe(scheduler->ipcWakeFd) < 0)
+    {
+        SCHED_PRINTF("[Scheduler] AddIpcHandler()->pipe() error!\n");
+        return ERR_SCHEDULER_SOCKET;
+    }
+#endif
+
+    ret = scheduler_handle_read(scheduler, scheduler->ipcWakeFd[0], IpcHandler, scheduler, NULL);
+    if (ret != ERR_SCHEDULER_OK)
+    {
+        DelIpcHandler(scheduler);
+        return ret;
+    }
 
-    scheduler_handle_read(scheduler, sock, IpcHandler, (void *)sock, NULL);
     return ERR_SCHEDULER_OK;
 }
 
-static void IpcHandler(void *data)
+static void DelIpcHandler(SchedulerT *scheduler)
+{
+    if (scheduler->ipcWakeFd[0] < 0)
+    {
+        return;
+    }
+
+    scheduler_unhandle_read(scheduler, scheduler->ipcWakeFd[0]);
+    closesocket(scheduler->ipcWakeFd[0]);
+    if (scheduler->ipcWakeFd[1] != scheduler->ipcWakeFd[0])
+    {
+        closesocket(scheduler->ipcWakeFd[1]);
+    }
+    scheduler->ipcWakeFd[0] = scheduler->ipcWakeFd[1] = -1;
+}
+
+static SchedIpcMsgT* NewIpcMsg(SchedulerT *scheduler, enum SchedIpcCmdE type)
 {
+    SchedIpcMsgT *msg;
+
+    if (scheduler == NULL || !scheduler->enableIPC)   // this scheduler doesn't enable IPC Interface
+    {
+        return NULL;
+    }
+
+    msg = (SchedIpcMsgT *)MALLOC(sizeof(SchedIpcMsgT));
+    if (msg != NULL)
+    {
+        MEMSET(msg, 0, sizeof(SchedIpcMsgT));
+        msg->type = type;
+    }
+    return msg;
+}
+
+// Multi-producer side of the IPC queue, safe to call from any thread.
+// It can't fail once the message is queued, the scheduler handles it then
+static int PostIpcMsg(SchedulerT *scheduler, SchedIpcMsgT *msg)
+{
+    SchedIpcMsgT *prev;
+    unsigned long long one = 1;
     int ret;
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrLen = sizeof(fromAddr);
-    int sock = (int)data;
-    SchedIpcMsgT ipcMsg;
 
-    if (sock < 0) return;
-    ret = recvfrom(sock, &ipcMsg, sizeof(ipcMsg), 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
-    if (ret < 0 || ret != (int)sizeof(ipcMsg))   // Error happened, just return
+    msg->next = NULL;
+    prev = __atomic_exchange_n(&scheduler->ipcQHead, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+
+    // Only the first poster after the scheduler drained the queue pays for the wakeup
+    if (__atomic_exchange_n(&scheduler->ipcWakePending, 1, __ATOMIC_SEQ_CST) == 0)
     {
-        SCHED_PRINTF("[Scheduler] IpcHandler()->recvfrom() %d!\n", ret);
-        return;
+#if defined(LINUX_ENV)
+        ret = write(scheduler->ipcWakeFd[1], &one, sizeof(one));
+#else
+        ret = write(scheduler->ipcWakeFd[1], &one, 1);
+#endif
+        if (ret < 0 && errno != EAGAIN)
+        {
+            // The message is queued all the same, so it is posted: the caller
+            // must not clean it up. Let the next poster try the wakeup again
+            SCHED_PRINTF("[Scheduler] PostIpcMsg()->write() error! %d\n", errno);
+            __atomic_store_n(&scheduler->ipcWakePending, 0, __ATOMIC_SEQ_CST);
+        }
     }
 
-    if (ipcMsg.magicId != SCHEDULER_IPC_MSG_MAGIC_ID)   // Error data, just return
+    return ERR_SCHEDULER_OK;
+}
+
+// Single-consumer side of the IPC queue, only called by the scheduler thread
+static SchedIpcMsgT* PopIpcMsg(SchedulerT *scheduler)
+{
+    SchedIpcMsgT *tail = scheduler->ipcQTail;
+    SchedIpcMsgT *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &scheduler->ipcStub)
     {
-        SCHED_PRINTF("[Scheduler] IPC data error!\n");
-        return;
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        scheduler->ipcQTail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL)
+    {
+        scheduler->ipcQTail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&scheduler->ipcQHead, __ATOMIC_ACQUIRE))
+    {
+        // A producer is in the middle of a push, it will wake us up again
+        return NULL;
+    }
+
+    // "tail" is the last message, put the stub behind it so we can take it
+    PostIpcStub(scheduler);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        scheduler->ipcQTail = next;
+        return tail;
     }
 
-    switch (ipcMsg.type)
+    return NULL;
+}
+
+static void PostIpcStub(SchedulerT *scheduler)
+{
+    SchedIpcMsgT *prev;
+
+    scheduler->ipcStub.next = NULL;
+    prev = __atomic_exchange_n(&scheduler->ipcQHead, &scheduler->ipcStub, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, &scheduler->ipcStub, __ATOMIC_RELEASE);
+}
+
+static void HandleIpcMsg(SchedulerT *scheduler, SchedIpcMsgT *msg)
+{
+    switch (msg->type)
     {
         case SCHED_CMD_DELAY:
-        {
-            SchedulerT *scheduler = (SchedulerT *)ipcMsg.param0;
-            unsigned int msec = (unsigned int)ipcMsg.param1;
-            unsigned int flag = (unsigned int)ipcMsg.param2;
-            SchedProcT proc = (SchedProcT)ipcMsg.param3;
-            void *clientData = (void*)ipcMsg.param4;
-            SchedProcT cleanUp = (SchedProcT)ipcMsg.param5;
-            ipcMsg.ret = scheduler_delay_task(scheduler, msec, flag, proc, clientData, cleanUp);
+            scheduler_delay_task_us(scheduler, msg->usec, msg->flag, msg->proc, msg->clientData, msg->cleanUp);
             break;
-        }
         case SCHED_CMD_UNDELAY:
-        {
-            SchedulerT *scheduler = (SchedulerT *)ipcMsg.param0;
-            int token = (int)ipcMsg.param1;
-            ipcMsg.ret = scheduler_undelay_task(scheduler, token);
+            scheduler_undelay_task(scheduler, msg->taskId);
             break;
-        }
         case SCHED_CMD_HANDLE_READ:
-        {
-            SchedulerT *scheduler = (SchedulerT *)ipcMsg.param0;
-            int sock = (int)ipcMsg.param1;
-            SchedProcT handlerProc = (SchedProcT)ipcMsg.param2;
-            void *clientData = (void*)ipcMsg.param3;
-            SchedProcT cleanUp = (SchedProcT)ipcMsg.param4;
-            ipcMsg.ret = scheduler_handle_read(scheduler, sock, handlerProc, clientData, cleanUp);
+            scheduler_handle_read(scheduler, msg->sock, msg->proc, msg->clientData, msg->cleanUp);
             break;
-        }
         case SCHED_CMD_UNHANDLE_READ:
-        {
-            SchedulerT *scheduler = (SchedulerT *)ipcMsg.param0;
-            int sock = (int)ipcMsg.param1;
-            ipcMsg.ret = scheduler_unhandle_read(scheduler, sock);
+            scheduler_unhandle_read(scheduler, msg->sock);
             break;
-        }
         default:
             break;
     }
-
+    FREE(msg);
 }
 
+static void IpcHandler(void *data)
+{
+    SchedulerT *scheduler = (SchedulerT *)data;
+    SchedIpcMsgT *msg;
+    unsigned long long count;
+    int num = 0;
+
+    while (read(scheduler->ipcWakeFd[0], &count, sizeof(count)) > 0)
+    {
+        // eventfd returns the whole counter at once, a pipe may need a few reads
+    }
+    // Re-arm the wakeup before draining, anything posted from now on
+    // either shows up below or writes the wakeup descriptor again
+    __atomic_store_n(&scheduler->ipcWakePending, 0, __ATOMIC_SEQ_CST);
 
+    while (num < SCHEDULER_IPC_BUDGET && (msg = PopIpcMsg(scheduler)) != NULL)
+    {
+        HandleIpcMsg(scheduler, msg);
+        num++;
+    }
+
+    if (num == SCHEDULER_IPC_BUDGET)
+    {
+        // Leave the rest for the next step so sockets and timers keep running
+        __atomic_store_n(&scheduler->ipcWakePending, 1, __ATOMIC_SEQ_CST);
+        count = 1;
+#if defined(LINUX_ENV)
+        write(scheduler->ipcWakeFd[1], &count, sizeof(count));
+#else
+        write(scheduler->ipcWakeFd[1], &count, 1);
+#endif
+    }
+}
@@ -1,6 +1,7 @@
 #ifndef __SCHEDULER_H__
 #define __SCHEDULER_H__
 
+#include "net_poller.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,30 +11,61 @@ extern "C" {
 #define DELAYTASK_FLAG_PERIODIC         0x02
 
 typedef void (*SchedProcT)(void* clientData);
+// Identifies a delayed Task: slot in the task slab and generation of that slot
+typedef unsigned long long SchedTaskIdT;
+#define SCHED_TASK_ID_INVALID           0
 
 typedef struct _SchedulerT SchedulerT;
 typedef struct _SchedulerParamT
 {
-    int enableIPC; // bool var
-    unsigned short ipcPort; // host order byte
+    int enableIPC; // bool var, allow other threads to use the xxx_remote() interfaces
+    PollerTypeE pollerType; // I/O multiplexing backend, POLLER_TYPE_DEFAULT picks the best one
+    int dispatchBudget; // max socket handlers called per single step, 0 for every ready socket
+    unsigned int busyPollUs; // max microseconds spent spinning on non-blocking polls before a blocking wait, 0 never spins
 } SchedulerParamT;
 
+typedef struct _SchedulerStatsT
+{
+    unsigned long long steps; // scheduler_single_step() calls
+    unsigned long long spinPolls; // non-blocking polls made while busy polling
+    unsigned long long spinHits; // busy polls which got an event, no blocking wait needed
+    unsigned long long sleeps; // blocking waits
+    unsigned long long spinUs; // microseconds spent busy polling
+    unsigned long long sleepUs; // microseconds spent in blocking waits
+    unsigned int busyPollUs; // the busy poll window now, adapted to eventGapUs
+    unsigned int eventGapUs; // smoothed time between the steps which got events
+} SchedulerStatsT;
+
 // Scheduler Interfaces:
 int scheduler_open(SchedulerT **pScheduler, SchedulerParamT *param);
 int scheduler_close(SchedulerT **pScheduler);
 int scheduler_single_step(SchedulerT *scheduler, unsigned int defaultMsec);
+unsigned long long scheduler_now(SchedulerT *scheduler);
+int scheduler_get_stats(SchedulerT *scheduler, SchedulerStatsT *stats);
 
 // Delay Task Interfaces:
-int scheduler_delay_task(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp);
-int scheduler_undelay_task(SchedulerT *scheduler, int token);
+SchedTaskIdT scheduler_delay_task(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp);
+int scheduler_undelay_task(SchedulerT *scheduler, SchedTaskIdT taskId);
+int scheduler_reschedule_task(SchedulerT *scheduler, SchedTaskIdT taskId, unsigned int msec);
+SchedTaskIdT scheduler_delay_task_us(SchedulerT *scheduler, unsigned long long usec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp);
+int scheduler_reschedule_task_us(SchedulerT *scheduler, SchedTaskIdT taskId, unsigned long long usec);
+
+// IPC Interfaces, can be called from any thread:
 int scheduler_delay_task_remote(SchedulerT *scheduler, unsigned int msec, unsigned int flag, SchedProcT proc, void *clientData, SchedProcT cleanUp);
+int scheduler_undelay_task_remote(SchedulerT *scheduler, SchedTaskIdT taskId);
+int scheduler_handle_read_remote(SchedulerT *scheduler, int sock, \
+                                 SchedProcT handlerProc, void *clientData, SchedProcT cleanUp);
+int scheduler_unhandle_read_remote(SchedulerT *scheduler, int sock);
 
 // Socket Event Handler Interfaces:
 int scheduler_handle_read(SchedulerT *scheduler, int sock, \
                           SchedProcT handlerProc, void *clientData, SchedProcT cleanUp);
 int scheduler_unhandle_read(SchedulerT *scheduler, int sock);
+int scheduler_handle_write(SchedulerT *scheduler, int sock, SchedProcT handlerProc, void *clientData);
+int scheduler_unhandle_write(SchedulerT *scheduler, int sock);
+int scheduler_suspend_read(SchedulerT *scheduler, int sock);
+int scheduler_resume_read(SchedulerT *scheduler, int sock);
 
-#define SCHEDULER_DEFAULT_IPC_PORT	7777
 // Error code
 #define ERR_SCHEDULER_OK		(0)
 #define ERR_SCHEDULER_DELAYQ_EMPTY		(101)
@@ -1,12 +1,47 @@
-
+#if defined(LINUX_ENV) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sched_setaffinity()
+#endif
 #include "config.h"
+#if defined(LINUX_ENV)
+#include <sched.h>
+#endif
 #include "net_list.h"
 #include "net_scheduler.h"
 #include "net_session.h"
 #include "net_server.h"
 
+// A connection accepted by reactors[0] and handed off to another reactor
+typedef struct _ServerAttachT
+{
+    ReactorT *reactor;
+    int sock;
+} ServerAttachT;
+
+// sid = generation << 32 | reactor index << 24 | slot + 1, never SESSION_ID_INVALID
+#define SERVER_SID(gen, index, slot) (((SessionIdT)(gen) << 32) | ((SessionIdT)(index) << 24) | (SessionIdT)((slot) + 1))
+#define SERVER_SID_GEN(sid) ((unsigned int)((sid) >> 32))
+#define SERVER_SID_INDEX(sid) ((int)(((sid) >> 24) & 0xff))
+#define SERVER_SID_SLOT(sid) ((int)((sid) & 0xffffff) - 1)
+#define SERVER_SLOT_MAX 0xfffffe // sessions per reactor
+#define SERVER_SLOT_INIT_CAP 64
+
 ServerT *net_server = NULL;
 static void server_connection_handler(ServerT *server);
+static void server_dispatch_connection(ServerT *server, int clientSock);
+static void server_attach_handler(ServerAttachT *attach);
+static void server_attach_cleanup(ServerAttachT *attach);
+static int server_reactor_open(ServerT *server, ReactorT *reactor, int index, int cpu);
+static int server_reactor_alloc(ReactorT *reactor);
+#if defined(LINUX_ENV)
+static void *server_reactor_alloc_thread(void *data);
+#endif
+static void server_reactor_close(ReactorT *reactor);
+static void *server_reactor_thread(void *data);
+static void server_reactor_run(ReactorT *reactor);
+static ReactorT *server_pick_reactor(ServerT *server, int sock);
+static int server_grow_sock_table(ReactorT *reactor, int sock);
+static int server_grow_slots(ReactorT *reactor);
+static int server_bind_cpu(int cpu);
 
 ServerT* server_get(void)
 {
@@ -22,28 +57,73 @@ int server_init(void)
     return 0;
 }
 
-int server_open(ServerT **pServer, unsigned short port)
+int server_open(ServerT **pServer, ServerParamT *param)
 {
-    int sock, ret=0;
+    int sock, i, ret=0;
     ServerT *server;
     struct sockaddr_in addr;
-    SchedulerParamT param;
+    unsigned short port = 0;
+    unsigned int maxSessions = SESSION_MAX_NUM;
+    unsigned int maxPacketLen = SESSION_PACKET_MAX;
+    int backlog = SERVER_BACKLOG;
+    unsigned int deferAcceptSec = 0;
+    int reactorNum = 1;
+    PollerTypeE pollerType = POLLER_TYPE_DEFAULT;
+    unsigned int busyPollUs = 0;
+    unsigned int coroutineStackSize = 0;
+    WorkerParamT workerParam;
+
+    MEMSET(&workerParam, 0, sizeof(workerParam));
+    workerParam.threadNum = SERVER_WORKER_NUM;
+    workerParam.queueMax = SERVER_WORKER_QUEUE_MAX;
+    if (param != NULL)
+    {
+        port = param->port;
+        if (param->maxSessions > 0) maxSessions = param->maxSessions;
+        if (param->maxPacketLen > 0) maxPacketLen = param->maxPacketLen;
+        // A packet, its header and the end of its data are counted in an unsigned int
+        if (maxPacketLen > 0xffffffffU - PACKET_HEADER_EXT_LEN - 1) maxPacketLen = 0xffffffffU - PACKET_HEADER_EXT_LEN - 1;
+        if (param->backlog > 0) backlog = param->backlog;
+        deferAcceptSec = param->deferAcceptSec;
+        reactorNum = param->reactorNum;
+        pollerType = param->pollerType;
+        busyPollUs = param->busyPollUs;
+        coroutineStackSize = param->coroutineStackSize;
+        if (param->workerNum > 0) workerParam.threadNum = param->workerNum;
+        workerParam.cpus = param->workerCpus;
+        workerParam.cpuNum = param->workerCpuNum;
+    }
+    if (port == 0)
+    {
+        // Use default port number;
+        port = SERVER_PORT;
+    }
+#if defined(LINUX_ENV)
+    if (reactorNum < 1) reactorNum = 1;
+    if (reactorNum > SERVER_REACTOR_MAX) reactorNum = SERVER_REACTOR_MAX;
+#else
+    reactorNum = 1;
+#endif
 
     server = MALLOC(sizeof(ServerT));
     if (server == NULL)
     {
         return ERR_MALLOC;
     }
+    MEMSET(server, 0, sizeof(ServerT));
 
-    if (port == 0)
+    server->reactors = MALLOC(reactorNum * sizeof(ReactorT));
+    if (server->reactors == NULL)
     {
-        // Use default port number;
-        port = SERVER_PORT;
+        FREE(server);
+        return ERR_MALLOC;
     }
 
     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock < 0)
     {
+        FREE(server->reactors);
+        FREE(server);
         return -1;
     }
 
@@ -53,9 +133,11 @@ int server_open(ServerT **pServer, unsigned short port)
     if (ret < 0)
     {
         closesocket(sock);
+        FREE(server->reactors);
+        FREE(server);
         return -1;
     }
-    
+
     MEMSET(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -64,93 +146,544 @@ int server_open(ServerT **pServer, unsigned short port)
     if (ret < 0)
     {
         closesocket(sock);
+        FREE(server->reactors);
+        FREE(server);
         return -1;
     }
 
-    ret = listen(sock, 10);
+#if defined(TCP_DEFER_ACCEPT)
+    if (deferAcceptSec > 0)
+    {
+        // Not fatal, the sessions are just opened before their first request
+        setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *)&deferAcceptSec, sizeof(deferAcceptSec));
+    }
+#endif
+
+    ret = listen(sock, backlog);
     if (ret < 0)
     {
         closesocket(sock);
+        FREE(server->reactors);
+        FREE(server);
         return -1;
     }
 
+#if defined(LINUX_ENV)
+    // The connection handler drains the backlog until accept() would block
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0)
+    {
+        closesocket(sock);
+        FREE(server->reactors);
+        FREE(server);
+        return -1;
+    }
+#endif
+
     server->sock = sock;
-    server->udpSock = -1;
     server->port = port;
     server->clientNum = 0;
-    list_init(&(server->clientList));
-    param.enableIPC = 1;
-    param.ipcPort = SCHEDULER_DEFAULT_IPC_PORT;
-    scheduler_open(&server->scheduler, &param);
+    server->rejectNum = 0;
+    server->maxSessions = maxSessions;
+    server->maxPacketLen = maxPacketLen;
+    server->coroutineStackSize = coroutineStackSize;
+    server->nextReactor = 0;
+    server->running = 0;
+    server->pollerType = pollerType;
+    server->busyPollUs = busyPollUs;
+    server->pinned = (param != NULL && param->reactorCpus != NULL && param->reactorCpuNum > 0);
+    session_init();
+    for (i = 0; i < reactorNum; i++)
+    {
+        ret = server_reactor_open(server, &server->reactors[i], i, \
+                                  server->pinned ? param->reactorCpus[i % param->reactorCpuNum] : -1);
+        if (ret != ERR_OK)
+        {
+            while (--i >= 0) server_reactor_close(&server->reactors[i]);
+            closesocket(sock);
+            FREE(server->reactors);
+            FREE(server);
+            return ret;
+        }
+        server->reactorNum++;
+    }
+
+    if (worker_pool_open(&server->workers, &workerParam) != ERR_WORKER_OK)
+    {
+        server->workers = NULL;
+    }
 
-    scheduler_handle_read(server->scheduler, sock, (SchedProcT)server_connection_handler, server, NULL);
+    // The first reactor accepts the connections for all of them
+    scheduler_handle_read(server->reactors[0].scheduler, sock, (SchedProcT)server_connection_handler, server, NULL);
 
     *pServer = server;
     return ret;
 }
 
+/**
+ * @brief Run the server until server_stop() is called
+ * reactors[1..n] get their own threads, reactors[0] runs on the calling thread,
+ * which is pinned to the CPU of reactors[0] if the reactors are pinned
+ */
 int server_start(ServerT *server)
 {
-    while (1)
+    int i;
+
+    __atomic_store_n(&server->running, 1, __ATOMIC_RELEASE);
+#if defined(LINUX_ENV)
+    for (i = 1; i < server->reactorNum; i++)
     {
-        scheduler_single_step(server->scheduler, 1000);
+        if (pthread_create(&server->reactors[i].thread, NULL, server_reactor_thread, &server->reactors[i]) != 0)
+        {
+            DPRINTF("reactor %d pthread_create() failed!\n", i);
+            server_stop(server);
+            while (--i >= 1) pthread_join(server->reactors[i].thread, NULL);
+            return ERR_UNKNOWN;
+        }
     }
+#endif
 
+    server_reactor_thread(&server->reactors[0]);
+
+#if defined(LINUX_ENV)
+    for (i = 1; i < server->reactorNum; i++)
+    {
+        pthread_join(server->reactors[i].thread, NULL);
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Ask all the reactors to leave their loop, can be called from any thread
+ */
+int server_stop(ServerT *server)
+{
+    __atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
     return 0;
 }
 
 int server_close(ServerT **pServer)
 {
     ServerT *server = *pServer;
-    
-    scheduler_close(&server->scheduler);
+    int i;
+
+    // Offloaded requests post their responses to the reactors, stop them first
+    if (server->workers)
+    {
+        worker_pool_close(&server->workers);
+    }
+
+    // Sessions are gone before the listening socket and reactors[0]
+    for (i = server->reactorNum - 1; i >= 0; i--)
+    {
+        server_reactor_close(&server->reactors[i]);
+    }
+    closesocket(server->sock);
+    FREE(server->reactors);
     FREE(server);
     *pServer = NULL;
 
     return 0;
 }
 
-SessionT* server_find_session(ServerT *server, int sid)
+/**
+ * @brief Put a session into the session table of its reactor and give it a sid
+ * Runs on the reactor thread, like the other session table interfaces
+ *
+ * @param [in] reactor the reactor the session lives on
+ * @param [in] session the session, its "sock" is set already
+ * @return status code
+ */
+int server_add_session(ReactorT *reactor, SessionT *session)
+{
+    int slot;
+
+    if (session->sock < 0) return ERR_SOCKET;
+    if (session->sock >= reactor->sockTableCap && server_grow_sock_table(reactor, session->sock) != ERR_OK)
+    {
+        return ERR_MALLOC;
+    }
+    if (reactor->freeSlot < 0 && server_grow_slots(reactor) != ERR_OK)
+    {
+        return ERR_MALLOC;
+    }
+
+    slot = reactor->freeSlot;
+    reactor->freeSlot = reactor->slots[slot].nextFree;
+    reactor->slots[slot].session = session;
+    reactor->sockTable[session->sock] = session;
+    session->slot = slot;
+    session->sid = SERVER_SID(reactor->slots[slot].gen, reactor->index, slot);
+    reactor->clientNum++;
+    return ERR_OK;
+}
+
+void server_remove_session(ReactorT *reactor, SessionT *session)
+{
+    SessionSlotT *slot = &reactor->slots[session->slot];
+
+    slot->session = NULL;
+    slot->gen++;
+    slot->nextFree = reactor->freeSlot;
+    reactor->freeSlot = session->slot;
+    reactor->sockTable[session->sock] = NULL;
+    reactor->clientNum--;
+}
+
+// NULL if the session of "sid" is gone, a stale sid never matches the session reusing its slot
+SessionT* server_find_session(ReactorT *reactor, SessionIdT sid)
+{
+    SessionSlotT *slot;
+    int index = SERVER_SID_SLOT(sid);
+
+    if (SERVER_SID_INDEX(sid) != reactor->index || index < 0 || index >= reactor->slotCap)
+    {
+        return NULL;
+    }
+    slot = &reactor->slots[index];
+    if (slot->session == NULL || slot->gen != SERVER_SID_GEN(sid))
+    {
+        return NULL;
+    }
+    return slot->session;
+}
+
+SessionT* server_find_session_by_sock(ReactorT *reactor, int sock)
+{
+    if (sock < 0 || sock >= reactor->sockTableCap)
+    {
+        return NULL;
+    }
+    return reactor->sockTable[sock];
+}
+
+static int server_grow_sock_table(ReactorT *reactor, int sock)
+{
+    SessionT **table;
+    int cap;
+
+    cap = reactor->sockTableCap ? reactor->sockTableCap : SERVER_SLOT_INIT_CAP;
+    while (cap <= sock)
+    {
+        cap *= 2;
+    }
+
+    table = (SessionT **)MALLOC(cap * sizeof(SessionT *));
+    if (table == NULL)
+    {
+        return ERR_MALLOC;
+    }
+    MEMSET(table, 0, cap * sizeof(SessionT *));
+    if (reactor->sockTable)
+    {
+        memcpy(table, reactor->sockTable, reactor->sockTableCap * sizeof(SessionT *));
+        FREE(reactor->sockTable);
+    }
+    reactor->sockTable = table;
+    reactor->sockTableCap = cap;
+
+    return ERR_OK;
+}
+
+// Double the session table, the new slots go to the free list lowest first
+static int server_grow_slots(ReactorT *reactor)
+{
+    SessionSlotT *slots;
+    int i, cap;
+
+    if (reactor->slotCap > SERVER_SLOT_MAX / 2)
+    {
+        return ERR_UNKNOWN;
+    }
+    cap = reactor->slotCap ? reactor->slotCap * 2 : SERVER_SLOT_INIT_CAP;
+
+    slots = (SessionSlotT *)MALLOC(cap * sizeof(SessionSlotT));
+    if (slots == NULL)
+    {
+        return ERR_MALLOC;
+    }
+    if (reactor->slots)
+    {
+        memcpy(slots, reactor->slots, reactor->slotCap * sizeof(SessionSlotT));
+        FREE(reactor->slots);
+    }
+    for (i = cap - 1; i >= reactor->slotCap; i--)
+    {
+        slots[i].session = NULL;
+        slots[i].gen = 0;
+        slots[i].nextFree = reactor->freeSlot;
+        reactor->freeSlot = i;
+    }
+    reactor->slots = slots;
+    reactor->slotCap = cap;
+
+    return ERR_OK;
+}
+
+static int server_reactor_open(ServerT *server, ReactorT *reactor, int index, int cpu)
+{
+#if defined(LINUX_ENV)
+    void *result;
+#endif
+
+    MEMSET(reactor, 0, sizeof(ReactorT));
+    reactor->index = index;
+    reactor->ourServer = server;
+    reactor->clientNum = 0;
+    reactor->cpu = cpu;
+    reactor->freeSlot = -1;
+
+#if defined(LINUX_ENV)
+    if (cpu >= 0 && pthread_create(&reactor->thread, NULL, server_reactor_alloc_thread, reactor) == 0)
+    {
+        pthread_join(reactor->thread, &result);
+        return (int)(long)result;
+    }
+#endif
+    return server_reactor_alloc(reactor);
+}
+
+#if defined(LINUX_ENV)
+// A page goes to the NUMA node of the CPU touching it first, so a pinned
+// reactor gets its scheduler, pools and arena from a thread on its CPU
+static void *server_reactor_alloc_thread(void *data)
+{
+    ReactorT *reactor = (ReactorT *)data;
+
+    server_bind_cpu(reactor->cpu);
+    return (void *)(long)server_reactor_alloc(reactor);
+}
+#endif
+
+static int server_reactor_alloc(ReactorT *reactor)
+{
+    ServerT *server = (ServerT *)reactor->ourServer;
+    SchedulerParamT param;
+    int ret;
+
+    MEMSET(&param, 0, sizeof(param));
+    param.enableIPC = 1;
+    param.pollerType = server->pollerType;
+    param.dispatchBudget = SERVER_DISPATCH_BUDGET;
+    param.busyPollUs = server->busyPollUs;
+    ret = scheduler_open(&reactor->scheduler, &param);
+    if (ret != ERR_SCHEDULER_OK)
+    {
+        return ERR_UNKNOWN;
+    }
+
+    if (pool_open(&reactor->sessionPool, sizeof(SessionT)) != ERR_POOL_OK)
+    {
+        server_reactor_close(reactor);
+        return ERR_MALLOC;
+    }
+    if (pool_open(&reactor->replyPool, sizeof(SessionReplyT)) != ERR_POOL_OK)
+    {
+        server_reactor_close(reactor);
+        return ERR_MALLOC;
+    }
+    if (pool_open(&reactor->bufPool, sizeof(SessionBufT) + PACKET_HEADER_LEN + SESSION_POOL_BUF_LEN) != ERR_POOL_OK)
+    {
+        server_reactor_close(reactor);
+        return ERR_MALLOC;
+    }
+    if (pool_open(&reactor->recvPool, SESSION_BUFFER_SIZE) != ERR_POOL_OK)
+    {
+        server_reactor_close(reactor);
+        return ERR_MALLOC;
+    }
+    if (arena_open(&reactor->jsonArena, SESSION_ARENA_SIZE, SESSION_ARENA_MAX) != ERR_ARENA_OK)
+    {
+        server_reactor_close(reactor);
+        return ERR_MALLOC;
+    }
+
+    return ERR_OK;
+}
+
+static void server_reactor_close(ReactorT *reactor)
 {
-    ListNodeT *entry;
     SessionT *client;
+    int i;
 
-    entry = server->clientList.next;
-    while (entry != &server->clientList)
+    // Close the sessions first, so the async calls they still wait for stop
+    // posting to the scheduler before it drains its messages
+    for (i = 0; i < reactor->slotCap; i++)
     {
-        client = list_entry(entry, SessionT, listEntry);
-        if (client->sid == sid)
+        client = reactor->slots[i].session;
+        if (client != NULL)
         {
-            return client;
+            session_close(&client);
         }
-        entry = entry->next;
     }
+    // Closing the scheduler unhandles the remaining sockets
+    scheduler_close(&reactor->scheduler);
+    if (reactor->slots) FREE(reactor->slots);
+    if (reactor->sockTable) FREE(reactor->sockTable);
+    if (reactor->sessionPool) pool_close(&reactor->sessionPool);
+    if (reactor->replyPool) pool_close(&reactor->replyPool);
+    if (reactor->bufPool) pool_close(&reactor->bufPool);
+    if (reactor->recvPool) pool_close(&reactor->recvPool);
+    if (reactor->jsonArena) arena_close(&reactor->jsonArena);
+}
 
+static void *server_reactor_thread(void *data)
+{
+    ReactorT *reactor = (ReactorT *)data;
+
+    // The sessions, buffers and DelayTasks of the reactor are allocated on
+    // this thread from now on, pinning it keeps them on the local NUMA node
+    if (reactor->cpu >= 0 && server_bind_cpu(reactor->cpu) != 0)
+    {
+        DPRINTF("reactor %d can't bind to CPU %d\n", reactor->index, reactor->cpu);
+    }
+    server_reactor_run(reactor);
     return NULL;
 }
 
+static void server_reactor_run(ReactorT *reactor)
+{
+    ServerT *server = (ServerT *)reactor->ourServer;
+
+    while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE))
+    {
+        scheduler_single_step(reactor->scheduler, 1000);
+    }
+}
+
+// Accept the pending connections, up to SERVER_ACCEPT_BUDGET so the sessions
+// of reactors[0] get their turn during a connection storm
 static void server_connection_handler(ServerT *server)
 {
-    int clientSock, ret;
+    int clientSock, i;
     struct sockaddr_in clientAddr;
-    socklen_t clientAddrLen = sizeof(clientAddr);
+    socklen_t clientAddrLen;
+
+    for (i = 0; i < SERVER_ACCEPT_BUDGET; i++)
+    {
+        clientAddrLen = sizeof(clientAddr);
+#if defined(LINUX_ENV)
+        clientSock = accept4(server->sock, (struct sockaddr *)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        clientSock = accept(server->sock, (struct sockaddr *)&clientAddr, &clientAddrLen);
+#endif
+        if (clientSock < 0)
+        {
+#if defined(LINUX_ENV)
+            // The peer gave up while it was queued, try the next one
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+#endif
+            // Drained, or out of descriptors and the next step tries again
+            //DPRINTF("accept() failed\n");
+            return;
+        }
+        server_dispatch_connection(server, clientSock);
+#if !defined(LINUX_ENV)
+        // The listener blocks on the other platforms, one per readiness
+        return;
+#endif
+    }
+}
+
+// Open a session for an accepted connection on the reactor it belongs to
+static void server_dispatch_connection(ServerT *server, int clientSock)
+{
+    int ret;
     SessionT *client;
+    ReactorT *reactor;
+    ServerAttachT *attach;
 
-    clientSock = accept(server->sock, (struct sockaddr *)&clientAddr, &clientAddrLen);
-    if (clientSock < 0)
+    reactor = server_pick_reactor(server, clientSock);
+    if (reactor->index == 0)
     {
-        //DPRINTF("accept() failed\n");
+        // We are running on reactors[0], no need to hand it off
+        ret = session_open(&client, reactor, clientSock);
+        if (ret != ERR_OK)
+        {
+            DPRINTF("session_open() failed! %d\n", ret);
+            closesocket(clientSock);
+            __atomic_add_fetch(&server->rejectNum, 1, __ATOMIC_RELAXED);
+        }
         return;
     }
 
-    ret = session_open(&client, server, clientSock);
-    if (ret != ERR_OK)
+    attach = MALLOC(sizeof(ServerAttachT));
+    if (attach == NULL)
     {
-        DPRINTF("session_open() failed! %d\n", ret);
         closesocket(clientSock);
         return;
     }
+    attach->reactor = reactor;
+    attach->sock = clientSock;
+    ret = scheduler_delay_task_remote(reactor->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
+                                      (SchedProcT)server_attach_handler, attach, (SchedProcT)server_attach_cleanup);
+    if (ret != ERR_SCHEDULER_OK)
+    {
+        server_attach_cleanup(attach);
+    }
+}
+
+// The reactor pinned to the CPU which handles the packets of the connection
+// keeps them in its caches, the others are used round-robin
+static ReactorT *server_pick_reactor(ServerT *server, int sock)
+{
+#if defined(SO_INCOMING_CPU)
+    int cpu, i;
+    socklen_t len = sizeof(cpu);
+
+    if (server->pinned && getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, (char *)&cpu, &len) == 0 && cpu >= 0)
+    {
+        for (i = 0; i < server->reactorNum; i++)
+        {
+            if (server->reactors[i].cpu == cpu)
+            {
+                return &server->reactors[i];
+            }
+        }
+    }
+#endif
+    return &server->reactors[server->nextReactor++ % server->reactorNum];
+}
+
+// Pin the calling thread to one CPU
+static int server_bind_cpu(int cpu)
+{
+#if defined(LINUX_ENV)
+    cpu_set_t set;
+
+    if (cpu >= CPU_SETSIZE) return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    return -1;
+#endif
 }
 
+// Runs on the reactor the connection was handed off to
+static void server_attach_handler(ServerAttachT *attach)
+{
+    SessionT *client;
+    int ret;
 
+    ret = session_open(&client, attach->reactor, attach->sock);
+    if (ret != ERR_OK)
+    {
+        // The cleanup closes the socket
+        DPRINTF("session_open() failed! %d\n", ret);
+        __atomic_add_fetch(&((ServerT *)attach->reactor->ourServer)->rejectNum, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    attach->sock = -1; // owned by the session now
+}
+
+static void server_attach_cleanup(ServerAttachT *attach)
+{
+    if (attach->sock >= 0)
+    {
+        closesocket(attach->sock);
+    }
+    FREE(attach);
+}
 
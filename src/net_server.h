@@ -1,28 +1,101 @@
+
 #ifndef __NET_SERVER_H__
 #define __NET_SERVER_H__
 
 #include "net_scheduler.h"
+#include "net_worker.h"
 #include "net_list.h"
+#include "net_session.h"
+#include "net_pool.h"
+#include "net_arena.h"
+#if defined(LINUX_ENV)
+#include <pthread.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct _ServerParamT
+{
+    unsigned short port; // host order byte, 0 for SERVER_PORT
+    unsigned int maxSessions; // sessions of all reactors, 0 for SESSION_MAX_NUM
+    unsigned int maxPacketLen; // longer requests close their session, 0 for SESSION_PACKET_MAX
+    int backlog; // pending connections the kernel queues for us, 0 for SERVER_BACKLOG
+    unsigned int deferAcceptSec; // TCP_DEFER_ACCEPT, connections are accepted once data arrives, 0 is off
+    int reactorNum; // number of reactors, each one runs its own scheduler in its own thread
+    PollerTypeE pollerType; // I/O backend of the reactors, POLLER_TYPE_DEFAULT picks the best one
+    int workerNum; // threads running the SERVICE_FLAG_OFFLOAD services, 0 for SERVER_WORKER_NUM
+    unsigned int busyPollUs; // reactors spin up to this long before sleeping, also SO_BUSY_POLL of the sessions, 0 is off
+    unsigned int coroutineStackSize; // stack of a SERVICE_FLAG_COROUTINE request, 0 for COROUTINE_STACK_SIZE
+    const int *reactorCpus; // reactor i is pinned to reactorCpus[i % reactorCpuNum], NULL to leave them to the OS
+    int reactorCpuNum;
+    const int *workerCpus; // the same for the worker threads
+    int workerCpuNum;
+} ServerParamT;
+
+// A slot of the session table of a reactor
+typedef struct _SessionSlotT
+{
+    SessionT *session; // NULL if the slot is free
+    unsigned int gen; // bumped when the slot is freed, so the old sid doesn't match any more
+    int nextFree;
+} SessionSlotT;
+
+// A reactor owns a scheduler and the sessions living on it
+typedef struct _ReactorT
+{
+    int index;
+    SchedulerT *scheduler;
+    // Sessions are found by sid through "slots", and by socket through "sockTable"
+    SessionSlotT *slots;
+    int slotCap;
+    int freeSlot; // -1 if no slot is free
+    SessionT **sockTable;
+    int sockTableCap;
+    // Sessions and their small buffers come from the pools of their reactor
+    PoolT *sessionPool; // SessionT
+    PoolT *replyPool; // SessionReplyT
+    PoolT *bufPool; // SessionBufT of packets up to SESSION_POOL_BUF_LEN
+    PoolT *recvPool; // receive buffers, SESSION_BUFFER_SIZE bytes
+    ArenaT *jsonArena; // cJSON trees of the request served inline, reset after each one
+    unsigned int clientNum;
+    void *ourServer;
+    int cpu; // the CPU the reactor is pinned to, -1 if it isn't
+#if defined(LINUX_ENV)
+    pthread_t thread;
+#endif
+} ReactorT;
+
 typedef struct _ServerT
 {
     int sock;
-    int udpSock;
     unsigned short port; // host order byte
-    SchedulerT *scheduler;
-    ListNodeT clientList;
-    unsigned int clientNum;
+    ReactorT *reactors; // reactors[0] accepts the connections and runs on the server_start() caller
+    int reactorNum;
+    PollerTypeE pollerType;
+    unsigned int busyPollUs; // 0 if the reactors never spin
+    int pinned; // bool var, the reactors are pinned to CPUs
+    WorkerPoolT *workers; // NULL if the platform has no threads, services then run inline
+    unsigned int nextReactor; // round-robin for new connections
+    unsigned int clientNum; // sessions of all reactors
+    unsigned int rejectNum; // connections closed right after accept(), no session could be opened for them
+    unsigned int maxSessions;
+    unsigned int maxPacketLen;
+    unsigned int coroutineStackSize; // 0 for COROUTINE_STACK_SIZE
+    int running; // bool var
 } ServerT;
 
 ServerT* server_get(void);
 int server_init(void);
-int server_open(ServerT **pServer, unsigned short port);
+int server_open(ServerT **pServer, ServerParamT *param);
 int server_start(ServerT *server);
+int server_stop(ServerT *server);
 int server_close(ServerT **pServer);
+int server_add_session(ReactorT *reactor, SessionT *session);
+void server_remove_session(ReactorT *reactor, SessionT *session);
+SessionT* server_find_session(ReactorT *reactor, SessionIdT sid);
+SessionT* server_find_session_by_sock(ReactorT *reactor, int sock);
 
 #ifdef __cplusplus
 }
@@ -5,6 +5,19 @@
 
 ListNodeT service_list;
 
+// Services are invoked by all the reactor threads, register and deregister
+// take the lock exclusively
+#if defined(LINUX_ENV)
+static pthread_rwlock_t service_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define SERVICE_RDLOCK()    pthread_rwlock_rdlock(&service_lock)
+#define SERVICE_WRLOCK()    pthread_rwlock_wrlock(&service_lock)
+#define SERVICE_UNLOCK()    pthread_rwlock_unlock(&service_lock)
+#else
+#define SERVICE_RDLOCK()
+#define SERVICE_WRLOCK()
+#define SERVICE_UNLOCK()
+#endif
+
 static struct
 {
     int retCode;
@@ -14,11 +27,11 @@ static struct
     {-SERVICE_RET_OK, "Call Suceeded"},
     {-SERVICE_RET_UNKNOWN, "Unknown Error"},
     {-SERVICE_RET_INVALID, "Call Invalid"},
-    {-SERVICE_RET_NOT_FOUND, "Call Not Found"}
+    {-SERVICE_RET_NOT_FOUND, "Call Not Found"},
+    {-SERVICE_RET_BUSY, "Server Busy"}
 };
 
 static ServiceT *service_find(char *name);
-static cJSON *service_generate_response(int retCode);
 
 int service_init(void)
 {
@@ -27,6 +40,12 @@ int service_init(void)
 }
 
 int service_register(char *name, ServiceProcT proc, void *data)
+{
+    return service_register_ex(name, proc, data, 0);
+}
+
+// Same as service_register(), "flags" are SERVICE_FLAG_XXX
+int service_register_ex(char *name, ServiceProcT proc, void *data, unsigned int flags)
 {
     if (!name || !proc) return -1;
 
@@ -35,34 +54,83 @@ int service_register(char *name, ServiceProcT proc, void *data)
 
     service->name = STRDUP(name);
     service->proc = proc;
+    service->asyncProc = NULL;
     service->data = data;
+    service->flags = flags & ~SERVICE_FLAG_ASYNC;
+    SERVICE_WRLOCK();
     list_insert_before(&service_list, &service->listEntry);
+    SERVICE_UNLOCK();
 
     return 0;
 }
 
+/**
+ * @brief Register a service which answers through a completion handle
+ * The service may keep the handle and call service_complete() later from
+ * any thread, the request params stay valid until then
+ *
+ * @param [in] name the function name the requests call
+ * @param [in] proc the service function
+ * @param [in] data passed to the service in the completion handle
+ * @return status code
+ */
+int service_register_async(char *name, ServiceAsyncProcT proc, void *data)
+{
+    if (!name || !proc) return -1;
 
+    ServiceT *service = (ServiceT *)MALLOC(sizeof(ServiceT));
+    if (!service) return -1;
+
+    service->name = STRDUP(name);
+    service->proc = NULL;
+    service->asyncProc = proc;
+    service->data = data;
+    service->flags = SERVICE_FLAG_ASYNC;
+    SERVICE_WRLOCK();
+    list_insert_before(&service_list, &service->listEntry);
+    SERVICE_UNLOCK();
+
+    return 0;
+}
 
 int service_deregister(char *name)
 {
     ServiceT *service;
-    ListNodeT *entry;
 
-    entry = service_list.next;
-    while (entry != &service_list)
+    SERVICE_WRLOCK();
+    service = service_find(name);
+    if (service)
     {
-        service = list_entry(entry, ServiceT, listEntry);
-        if (!STRCMP(name, service->name))
-        {
-            list_remove(entry);
-            FREE(service->name);
-            FREE(service);
-            return 0;
-        }
-        entry = entry->next;
+        list_remove(&service->listEntry);
     }
+    SERVICE_UNLOCK();
+
+    if (!service) return -1; // not found
+    FREE(service->name);
+    FREE(service);
+    return 0;
+}
+
+// Flags of the service a request calls, 0 if it doesn't call a known one
+unsigned int service_get_flags(cJSON *root)
+{
+    cJSON *call, *function;
+    ServiceT *service;
+    unsigned int flags = 0;
 
-    return -1; // not found
+    if (!root) return 0;
+
+    call = cJSON_GetObjectItem(root, "call");
+    if (!call) return 0;
+    function = cJSON_GetObjectItem(call, "function");
+    if (!function || !function->valuestring) return 0;
+
+    SERVICE_RDLOCK();
+    service = service_find(function->valuestring);
+    if (service) flags = service->flags;
+    SERVICE_UNLOCK();
+
+    return flags;
 }
 
 cJSON *service_invoke(cJSON *root)
@@ -70,6 +138,7 @@ cJSON *service_invoke(cJSON *root)
     cJSON *res = NULL;
     cJSON *call, *function, *params;
     ServiceT *service;
+    ServiceProcT proc;
 
     if (!root) return NULL;
 
@@ -85,17 +154,22 @@ cJSON *service_invoke(cJSON *root)
         DPRINTF("Invalid request call -1 !\n");
         return service_generate_response(SERVICE_RET_INVALID);
     }
+    SERVICE_RDLOCK();
     service = service_find(function->valuestring);
     if (!service)
     {
+        SERVICE_UNLOCK();
         DPRINTF("Invalid request call -2 !\n");
         return service_generate_response(SERVICE_RET_NOT_FOUND);
     }
+    // Don't hold the lock while the service runs, a coroutine service may suspend
+    proc = service->proc;
+    SERVICE_UNLOCK();
 
     params = cJSON_GetObjectItem(call, "params");
-    if (service->proc)
+    if (proc)
     {
-        res = service->proc(params);
+        res = proc(params);
     }
 
     if (!res) return service_generate_response(SERVICE_RET_UNKNOWN);
@@ -104,7 +178,57 @@ cJSON *service_invoke(cJSON *root)
 
 }
 
-static cJSON *service_generate_response(int retCode)
+/**
+ * @brief Invoke the service a request calls, the response goes to call->complete
+ * The call is always completed exactly once: by the service if it is an
+ * async one, otherwise right away with the service response or an error
+ *
+ * @param [in] root the request, must stay valid until the call is completed
+ * @param [in] call the completion handle, "complete" filled in by the caller
+ */
+void service_invoke_async(cJSON *root, ServiceCallT *call)
+{
+    cJSON *item, *function;
+    ServiceT *service;
+    ServiceAsyncProcT asyncProc = NULL;
+
+    item = root ? cJSON_GetObjectItem(root, "call") : NULL;
+    function = item ? cJSON_GetObjectItem(item, "function") : NULL;
+    if (function && function->valuestring)
+    {
+        SERVICE_RDLOCK();
+        service = service_find(function->valuestring);
+        if (service && service->asyncProc)
+        {
+            asyncProc = service->asyncProc;
+            call->data = service->data;
+        }
+        SERVICE_UNLOCK();
+    }
+
+    if (!asyncProc)
+    {
+        // Not an async service (any more), answer it the synchronous way
+        call->data = NULL;
+        service_complete(call, service_invoke(root));
+        return;
+    }
+    asyncProc(cJSON_GetObjectItem(item, "params"), call);
+}
+
+/**
+ * @brief Answer an async call, can be called from any thread
+ *
+ * @param [in] call the completion handle the service got
+ * @param [in] res the response, owned by the call from now on, NULL for an error
+ */
+void service_complete(ServiceCallT *call, cJSON *res)
+{
+    if (!res) res = service_generate_response(SERVICE_RET_UNKNOWN);
+    call->complete(call, res);
+}
+
+cJSON *service_generate_response(int retCode)
 {
     cJSON *root = NULL;
     cJSON *ret = NULL;
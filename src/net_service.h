@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include "cJSON.h"
 #include "net_list.h"
+#include "net_worker.h"
+#include "net_coroutine.h"
 
 // service return code
 enum
@@ -12,22 +14,58 @@ enum
     SERVICE_RET_UNKNOWN,
     SERVICE_RET_INVALID,
     SERVICE_RET_NOT_FOUND,
+    SERVICE_RET_BUSY,
     SERVICE_RET_MAX
 };
 
+// A plain service runs inline on the reactor thread, the cJSON items it gets
+// or builds there come from an arena released once its response is sent: it
+// must not keep them, nor free() what cJSON allocated (cJSON_Delete() is fine)
+
+// service flags
+// An offloaded service runs on the worker pool instead of the reactor thread,
+// the subtasks it starts with worker_spawn() are run by the same pool
+#define SERVICE_FLAG_OFFLOAD    0x01
+// A coroutine service runs on the reactor thread in its own coroutine, it may
+// suspend with coroutine_sleep() or coroutine_wait_read() while the reactor goes on
+#define SERVICE_FLAG_COROUTINE  0x02
+// An async service gets a completion handle and may answer later from any
+// thread with service_complete(), it runs on the reactor thread and must not
+// block there. Set by service_register_async() only
+#define SERVICE_FLAG_ASYNC      0x04
+
 typedef cJSON* (*ServiceProcT)(cJSON *params);
 
+// The completion handle of an async call, embedded by the caller which
+// fills in how the response gets back to it
+typedef struct _ServiceCallT ServiceCallT;
+typedef void (*ServiceAsyncProcT)(cJSON *params, ServiceCallT *call);
+typedef void (*ServiceCompleteProcT)(ServiceCallT *call, cJSON *res);
+struct _ServiceCallT
+{
+    ServiceCompleteProcT complete; // called once by service_complete(), owns "res"
+    void *data; // the data the service was registered with
+};
+
 typedef struct _ServiceT
 {
     char *name;
     ServiceProcT proc;
+    ServiceAsyncProcT asyncProc; // SERVICE_FLAG_ASYNC services only
     void *data;
+    unsigned int flags; // SERVICE_FLAG_XXX
     ListNodeT listEntry;
 } ServiceT;
 
 int service_init(void);
 int service_register(char *name, ServiceProcT proc, void *data);
+int service_register_ex(char *name, ServiceProcT proc, void *data, unsigned int flags);
+int service_register_async(char *name, ServiceAsyncProcT proc, void *data);
 int service_deregister(char *name);
+unsigned int service_get_flags(cJSON *root);
 cJSON *service_invoke(cJSON *root);
+void service_invoke_async(cJSON *root, ServiceCallT *call);
+void service_complete(ServiceCallT *call, cJSON *res);
+cJSON *service_generate_response(int retCode);
 
 #endif //__SERVICE_H__
@@ -5,39 +5,201 @@
 #include "net_scheduler.h"
 #include "net_server.h"
 #include "net_service.h"
+#include "net_coroutine.h"
 #include "cJSON.h"
 
 
-static int session_cur_id = 0;
+// A request running on the worker pool, in a coroutine or as an async call,
+// and its response on the way back
+typedef struct _SessionJobT
+{
+    ServiceCallT call; // async calls only
+    ReactorT *reactor; // the reactor owning the session
+    SessionIdT sid; // the session may be gone when the response is back
+    cJSON *req;
+    cJSON *id; // the request id, moved into the response
+    cJSON *res; // response of a coroutine, printed once off its stack
+    char *out;
+    int unordered; // bool var, the request has an id, its response doesn't wait for the others
+    SessionReplyT *reply; // the response slot of an async call
+    int state; // SESSION_CALL_XXX, async calls only
+} SessionJobT;
+
+// Where an async call is, changed under session_call_lock
+enum
+{
+    SESSION_CALL_PENDING = 0, // the service has the call
+    SESSION_CALL_POSTED, // the response is on the way to the reactor
+    SESSION_CALL_DETACHED // the session is gone, the call frees itself when completed
+};
+
+// While a request is served inline, the cJSON calls of its reactor thread
+// allocate from the arena of the reactor
+#if defined(LINUX_ENV)
+static __thread ArenaT *session_json_arena;
+#else
+static ArenaT *session_json_arena;
+#endif
+
+// Async calls are completed by any thread while their session may close
+#if defined(LINUX_ENV)
+static pthread_mutex_t session_call_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SESSION_CALL_LOCK()     pthread_mutex_lock(&session_call_lock)
+#define SESSION_CALL_UNLOCK()   pthread_mutex_unlock(&session_call_lock)
+#else
+#define SESSION_CALL_LOCK()
+#define SESSION_CALL_UNLOCK()
+#endif
 
 static void session_cleanup(SessionT *client);
-static int session_gen_id(void);
+static void *session_json_malloc(size_t size);
+static void session_json_free(void *ptr);
 static void session_request_handler(SessionT *client);
-static int session_send_response(SessionT *session, cJSON *res);
-static void session_send(SessionT *session);
+static int session_recv_parse(SessionT *client);
+static void session_recv_resume(SessionT *client);
+static int session_dispatch(SessionT *client, cJSON *root);
+static void session_set_id(cJSON *res, cJSON *id);
+static char *session_json_print(cJSON *res);
+static int session_json_nested(cJSON *item, int limit);
+static int session_recv_attach(SessionT *session);
+static void session_recv_release(SessionT *session);
+static int session_recv_grow(SessionT *session);
+static void session_recv_compact(SessionT *session, unsigned int pos);
+static int session_send_response(SessionT *session, cJSON *res, int unordered);
+static int session_reply(SessionT *session, char *out);
+static int session_reply_flush(SessionT *session);
+static int session_send(SessionT *session, char *data, unsigned int len);
+static int session_flush(SessionT *session);
+static void session_flush_task(SessionT *session);
+static SessionBufT *session_buf_alloc(SessionT *session, unsigned int len);
+static void session_buf_free(SessionT *session, SessionBufT *buf);
+static void session_write_handler(SessionT *session);
+static unsigned int packet_header_len(char *header, unsigned int got);
 static int packet_get_len(char *header, unsigned int *len);
+static unsigned int packet_put_header(char *header, unsigned int len, int ext);
+static int session_offload(SessionT *session, cJSON *req, cJSON *id);
+static void session_job_run(SessionJobT *job);
+static void session_job_cleanup(SessionJobT *job);
+static SessionJobT *session_job_new(SessionT *session, cJSON *req, cJSON *id);
+static void session_job_abort(SessionT *session, SessionJobT *job);
+static void session_job_done(SessionJobT *job);
+static void session_job_free(SessionJobT *job);
+static int session_coroutine(SessionT *session, cJSON *req, cJSON *id);
+static void session_coroutine_run(SessionJobT *job);
+static void session_coroutine_done(SessionJobT *job);
+static int session_async(SessionT *session, cJSON *req, cJSON *id);
+static void session_async_complete(ServiceCallT *call, cJSON *res);
+static void session_async_detach(SessionJobT *job);
 
 
-int session_open(SessionT **pClient, void *ourServer, int sock)
+/**
+ * @brief Make cJSON allocate from the arena of a reactor while it serves a
+ * request inline, it uses the heap otherwise. Called by server_open()
+ *
+ * @return status code
+ */
+int session_init(void)
+{
+    cJSON_Hooks hooks;
+
+    hooks.malloc_fn = session_json_malloc;
+    hooks.free_fn = session_json_free;
+    cJSON_InitHooks(&hooks);
+
+    return ERR_OK;
+}
+
+static void *session_json_malloc(size_t size)
+{
+    void *ptr;
+
+    if (session_json_arena)
+    {
+        ptr = arena_alloc(session_json_arena, size);
+        if (ptr) return ptr;
+        // The arena is full, it grows on its next reset
+    }
+    return MALLOC(size);
+}
+
+// Arena memory is released all at once when the request is served
+static void session_json_free(void *ptr)
+{
+    if (session_json_arena && arena_owns(session_json_arena, ptr)) return;
+    FREE(ptr);
+}
+
+int session_open(SessionT **pClient, void *ourReactor, int sock)
 {
     SessionT *client;
-    ServerT *server = (ServerT *)ourServer;
+    ReactorT *reactor = (ReactorT *)ourReactor;
+    ServerT *server;
 
     if (sock < 0) return ERR_SOCKET;
-    if (!server || server->clientNum >= SESSION_MAX_NUM) return ERR_UNKNOWN;
-    client = MALLOC(sizeof(SessionT));
-    if (!client) return ERR_MALLOC;
+    if (!reactor) return ERR_UNKNOWN;
+    server = (ServerT *)reactor->ourServer;
+    // A slow client must never block the scheduler
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) return ERR_SOCKET;
+#if defined(SO_BUSY_POLL)
+    if (server->busyPollUs > 0)
+    {
+        // Let the kernel poll the device queue as well, this may need CAP_NET_ADMIN
+        int busyPoll = (int)server->busyPollUs;
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (char *)&busyPoll, sizeof(busyPoll));
+    }
+#endif
+    // We gather the packets ourselves, waiting for more only stalls the responses
+    {
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&noDelay, sizeof(noDelay));
+    }
+    // The limit is shared by all the reactors
+    if (__atomic_add_fetch(&server->clientNum, 1, __ATOMIC_RELAXED) > server->maxSessions)
+    {
+        __atomic_sub_fetch(&server->clientNum, 1, __ATOMIC_RELAXED);
+        return ERR_UNKNOWN;
+    }
+    client = pool_alloc(reactor->sessionPool);
+    if (!client)
+    {
+        __atomic_sub_fetch(&server->clientNum, 1, __ATOMIC_RELAXED);
+        return ERR_MALLOC;
+    }
 
     client->ourServer = server;
+    client->ourReactor = reactor;
     client->sock = sock;
+    client->requestBuf = NULL;
+    client->reqBufSize = 0;
+    client->extFrames = 0;
     client->reqBufPos = 0;
-    client->packetLen = 0;
-    client->sid = session_gen_id();
-    client->response = NULL;
+    client->readPaused = 0;
+    client->recvTask = SCHED_TASK_ID_INVALID;
+    client->flushTask = SCHED_TASK_ID_INVALID;
+    list_init(&client->sendQ);
+    client->sendQBytes = 0;
+    client->writeArmed = 0;
+    list_init(&client->replyQ);
+    list_init(&client->callList);
+    client->replyNum = 0;
+    client->asyncNum = 0;
 
-    list_insert_before(&server->clientList, &client->listEntry);
-    server->clientNum++;
-    scheduler_handle_read(server->scheduler, sock, (SchedProcT)session_request_handler, client, (SchedProcT)session_cleanup);
+    if (server_add_session(reactor, client) != ERR_OK)
+    {
+        __atomic_sub_fetch(&server->clientNum, 1, __ATOMIC_RELAXED);
+        pool_free(reactor->sessionPool, client);
+        return ERR_MALLOC;
+    }
+    if (scheduler_handle_read(reactor->scheduler, sock, (SchedProcT)session_request_handler, \
+                              client, (SchedProcT)session_cleanup) != ERR_SCHEDULER_OK)
+    {
+        // The poller can't watch it, e.g. select() and a socket beyond FD_SETSIZE.
+        // The caller closes the socket
+        server_remove_session(reactor, client);
+        __atomic_sub_fetch(&server->clientNum, 1, __ATOMIC_RELAXED);
+        pool_free(reactor->sessionPool, client);
+        return ERR_SOCKET;
+    }
 
     *pClient = client;
     return ERR_OK;
@@ -46,9 +208,9 @@ int session_open(SessionT **pClient, void *ourServer, int sock)
 int session_close(SessionT **pClient)
 {
     SessionT *client = *pClient;
-    ServerT *server = (ServerT *)client->ourServer;
+    ReactorT *reactor = (ReactorT *)client->ourReactor;
 
-    scheduler_unhandle_read(server->scheduler, client->sock);
+    scheduler_unhandle_read(reactor->scheduler, client->sock);
     //session_cleanup(client);
     
     *pClient = NULL;
@@ -58,134 +220,1021 @@ int session_close(SessionT **pClient)
 static void session_cleanup(SessionT *client)
 {
     ServerT *server = (ServerT *)client->ourServer;
-    
-    list_remove(&client->listEntry);
-    server->clientNum--;
+    ReactorT *reactor = (ReactorT *)client->ourReactor;
+    SessionBufT *buf;
+    SessionReplyT *reply;
+
+    server_remove_session(reactor, client);
+    __atomic_sub_fetch(&server->clientNum, 1, __ATOMIC_RELAXED);
     closesocket(client->sock);
-    if (client->response) FREE(client->response);
-    FREE(client);
+    if (client->requestBuf) session_recv_release(client);
+    if (client->recvTask != SCHED_TASK_ID_INVALID) scheduler_undelay_task(reactor->scheduler, client->recvTask);
+    if (client->flushTask != SCHED_TASK_ID_INVALID) scheduler_undelay_task(reactor->scheduler, client->flushTask);
+    while (!list_isempty(&client->sendQ))
+    {
+        buf = list_entry(client->sendQ.next, SessionBufT, listEntry);
+        list_remove(&buf->listEntry);
+        session_buf_free(client, buf);
+    }
+    while (!list_isempty(&client->replyQ))
+    {
+        reply = list_entry(client->replyQ.next, SessionReplyT, listEntry);
+        list_remove(&reply->listEntry);
+        if (reply->job) session_async_detach((SessionJobT *)reply->job);
+        if (reply->out) FREE(reply->out);
+        pool_free(reactor->replyPool, reply);
+    }
+    while (!list_isempty(&client->callList))
+    {
+        reply = list_entry(client->callList.next, SessionReplyT, listEntry);
+        list_remove(&reply->listEntry);
+        session_async_detach((SessionJobT *)reply->job);
+        pool_free(reactor->replyPool, reply);
+    }
+    pool_free(reactor->sessionPool, client);
 }
 
-static int session_send_response(SessionT *session, cJSON *res)
+// Send a response, an unordered one (the request has an id) doesn't wait
+// for the pending async calls
+static int session_send_response(SessionT *session, cJSON *res, int unordered)
 {
-    ServerT *server;
+    char *out, *copy;
+    int ret;
+
     if (!session || !res) return ERR_UNKNOWN;
 
-    if (session->response) FREE(session->response);
-    session->response = cJSON_Print(res);
-#if 1
-    session_send(session);
-    return 0;
-#else
-    server = (ServerT *)session->ourServer;
-    return scheduler_delay_task_remote(server->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
-                                        (SchedProcT)session_send, session, NULL);
-#endif
+    out = cJSON_Print(res);
+    if (!out) return ERR_MALLOC;
+    if (unordered || list_isempty(&session->replyQ))
+    {
+        // Copied into the output queue, it may be in the cJSON arena
+        ret = session_send(session, out, STRLEN(out));
+        session_json_free(out);
+        return ret;
+    }
+    // It waits behind the pending async calls, past the arena reset
+    copy = STRDUP(out);
+    session_json_free(out);
+    return session_reply(session, copy);
+}
+
+// Send a response, or queue it behind the pending async calls. Owns "out".
+static int session_reply(SessionT *session, char *out)
+{
+    SessionReplyT *reply;
+    int ret;
+
+    if (!out) return ERR_MALLOC;
+    if (list_isempty(&session->replyQ))
+    {
+        ret = session_send(session, out, STRLEN(out));
+        FREE(out);
+        return ret;
+    }
+
+    if (session->replyNum >= SESSION_REPLYQ_MAX)
+    {
+        DPRINTF("session %llx reply queue overflow!\n", session->sid);
+        FREE(out);
+        return ERR_UNKNOWN;
+    }
+    reply = pool_alloc(((ReactorT *)session->ourReactor)->replyPool);
+    if (!reply)
+    {
+        FREE(out);
+        return ERR_MALLOC;
+    }
+    reply->job = NULL;
+    reply->out = out;
+    list_insert_before(&session->replyQ, &reply->listEntry);
+    session->replyNum++;
+    return ERR_OK;
+}
+
+// Send the answered responses at the head of the reply queue
+static int session_reply_flush(SessionT *session)
+{
+    SessionReplyT *reply;
+    int ret;
+
+    while (!list_isempty(&session->replyQ))
+    {
+        reply = list_entry(session->replyQ.next, SessionReplyT, listEntry);
+        if (reply->job)
+        {
+            // Still pending, the ones behind it wait
+            break;
+        }
+        list_remove(&reply->listEntry);
+        session->replyNum--;
+        ret = reply->out ? session_send(session, reply->out, STRLEN(reply->out)) : ERR_UNKNOWN;
+        if (reply->out) FREE(reply->out);
+        pool_free(((ReactorT *)session->ourReactor)->replyPool, reply);
+        if (ret != ERR_OK) return ret;
+    }
+
+    return ERR_OK;
+}
+
+// Queue a packet for the client and send as much as the socket takes now
+static int session_send(SessionT *session, char *data, unsigned int len)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+    SessionBufT *buf;
+    unsigned int headerLen;
+    int ret;
+
+    if (len >= PACKET_LEN_ESCAPE && !session->extFrames)
+    {
+        DPRINTF("session %llx response too long for a 2-byte header!\n", session->sid);
+        return ERR_UNKNOWN;
+    }
+    headerLen = (len >= PACKET_LEN_ESCAPE) ? PACKET_HEADER_EXT_LEN : PACKET_HEADER_LEN;
+    if (session->sendQBytes > 0 && session->sendQBytes + headerLen + len > SESSION_SENDQ_MAX && !session->writeArmed)
+    {
+        // Don't count the corked packets, they may go out right now
+        ret = session_flush(session);
+        if (ret != ERR_OK) return ret;
+    }
+    // A packet longer than the limit still goes out once the queue is drained
+    if (session->sendQBytes > 0 && session->sendQBytes + headerLen + len > SESSION_SENDQ_MAX)
+    {
+        DPRINTF("session %llx output queue overflow!\n", session->sid);
+        return ERR_UNKNOWN;
+    }
+
+    buf = session_buf_alloc(session, headerLen + len);
+    if (!buf) return ERR_MALLOC;
+    packet_put_header(buf->data, len, headerLen == PACKET_HEADER_EXT_LEN);
+    memcpy(buf->data + headerLen, data, len);
+    buf->len = headerLen + len;
+    buf->pos = 0;
+    list_insert_before(&session->sendQ, &buf->listEntry);
+    session->sendQBytes += buf->len;
+
+    if (session->writeArmed || session->flushTask != SCHED_TASK_ID_INVALID)
+    {
+        // The socket is full already and the write handler will pick it up,
+        // or a flush is on the way
+        return ERR_OK;
+    }
+    // Cork the packets of this scheduler step, they go out together once the
+    // handlers are done
+    session->flushTask = scheduler_delay_task(reactor->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
+                                              (SchedProcT)session_flush_task, session, NULL);
+    if (session->flushTask == SCHED_TASK_ID_INVALID)
+    {
+        return session_flush(session);
+    }
+    return ERR_OK;
+}
+
+static void session_flush_task(SessionT *session)
+{
+    session->flushTask = SCHED_TASK_ID_INVALID;
+    if (session_flush(session) != ERR_OK)
+    {
+        session_close(&session);
+    }
 }
 
-static void session_send(SessionT *session)
+// Send queued packets until the queue is empty or the socket is full, up to
+// SESSION_IOV_MAX of them in one syscall
+static int session_flush(SessionT *session)
 {
-    unsigned short dataLen, netLen;
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+    struct iovec iov[SESSION_IOV_MAX];
+    struct msghdr msg;
+    SessionBufT *buf;
+    ListNodeT *entry;
+    size_t total, sent;
+    ssize_t ret;
+    int iovNum;
 
-    if (!session || !session->response) return;
+    while (!list_isempty(&session->sendQ))
+    {
+        // The first packet may be partly sent
+        iovNum = 0;
+        total = 0;
+        entry = session->sendQ.next;
+        while (entry != &session->sendQ && iovNum < SESSION_IOV_MAX)
+        {
+            buf = list_entry(entry, SessionBufT, listEntry);
+            iov[iovNum].iov_base = buf->data + buf->pos;
+            iov[iovNum].iov_len = buf->len - buf->pos;
+            total += iov[iovNum].iov_len;
+            iovNum++;
+            entry = entry->next;
+        }
+        MEMSET(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovNum;
+        ret = sendmsg(session->sock, &msg, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return ERR_SOCKET;
+            break;
+        }
 
-    dataLen = STRLEN(session->response);
-    netLen = htons(dataLen);
-    send(session->sock, &netLen, 2, 0);
-    send(session->sock, session->response, dataLen, 0);
-    FREE(session->response);
-    session->response = NULL;
-    return;
+        sent = (size_t)ret;
+        session->sendQBytes -= (unsigned int)sent;
+        while (sent > 0)
+        {
+            buf = list_entry(session->sendQ.next, SessionBufT, listEntry);
+            if (sent < buf->len - buf->pos)
+            {
+                buf->pos += (unsigned int)sent;
+                break;
+            }
+            sent -= buf->len - buf->pos;
+            list_remove(&buf->listEntry);
+            session_buf_free(session, buf);
+        }
+        if ((size_t)ret < total)
+        {
+            // Short write, the socket buffer is full
+            break;
+        }
+    }
+
+    if (!list_isempty(&session->sendQ) && !session->writeArmed)
+    {
+        if (scheduler_handle_write(reactor->scheduler, session->sock, (SchedProcT)session_write_handler, session) != ERR_SCHEDULER_OK)
+        {
+            return ERR_SOCKET;
+        }
+        session->writeArmed = 1;
+    }
+    else if (list_isempty(&session->sendQ) && session->writeArmed)
+    {
+        scheduler_unhandle_write(reactor->scheduler, session->sock);
+        session->writeArmed = 0;
+    }
+
+    return ERR_OK;
 }
 
-static int session_gen_id(void)
+// Small packets are queued in buffers of the reactor pool, the others are malloc'ed
+static SessionBufT *session_buf_alloc(SessionT *session, unsigned int len)
 {
-    session_cur_id = session_cur_id+1;
-    return (session_cur_id);
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+
+    if (len <= PACKET_HEADER_LEN + SESSION_POOL_BUF_LEN)
+    {
+        return pool_alloc(reactor->bufPool);
+    }
+    return MALLOC(sizeof(SessionBufT) + len);
+}
+
+static void session_buf_free(SessionT *session, SessionBufT *buf)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+
+    if (buf->len <= PACKET_HEADER_LEN + SESSION_POOL_BUF_LEN)
+    {
+        pool_free(reactor->bufPool, buf);
+        return;
+    }
+    FREE(buf);
+}
+
+static void session_write_handler(SessionT *session)
+{
+    if (session_flush(session) != ERR_OK)
+    {
+        session_close(&session);
+    }
 }
 
+// Read what the socket has, then serve every whole packet of it
 static void session_request_handler(SessionT *client)
 {
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrLen = sizeof(fromAddr);
-    unsigned int pos, left, packetLen = 0;
-    cJSON *root, *res;
+    unsigned int left;
     int ret;
 
-    pos = client->reqBufPos;
-    packetLen = client->packetLen;
-    if (packetLen == 0)
+    if (!client->requestBuf && session_recv_attach(client) != ERR_OK)
     {
-        // First we need to get the packet header
-        left = PACKET_HEADER_LEN - pos;
-        ret = recvfrom(client->sock, &client->requestBuf[pos], left, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
+        session_close(&client);
+        return;
+    }
+    // A full buffer holds the start of a long packet, or a whole packet
+    // that waited for a paused call
+    if (client->reqBufPos + 1 >= client->reqBufSize && session_recv_grow(client) != ERR_OK)
+    {
+        session_close(&client);
+        return;
+    }
+
+    left = client->reqBufSize - 1 - client->reqBufPos; // one byte is kept to end the data string
+    if (left > 0)
+    {
+        ret = recv(client->sock, &client->requestBuf[client->reqBufPos], left, 0);
         if (ret <= 0)
         {
+            // Nothing to read for now, this is not an error on a non-blocking socket
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                if (client->reqBufPos == 0) session_recv_release(client);
+                return;
+            }
             // Close client session;
             session_close(&client);
             return;
         }
         client->reqBufPos += (unsigned int)ret;
-        if (client->reqBufPos < PACKET_HEADER_LEN)
+    }
+
+    session_recv_parse(client);
+}
+
+// Serve the whole packets in the receive buffer, in order. Stops early when
+// a request pauses reading, the rest is served once its response is queued.
+// Returns an error if the session is closed.
+static int session_recv_parse(SessionT *client)
+{
+    ReactorT *reactor = (ReactorT *)client->ourReactor;
+    SessionIdT sid = client->sid;
+    unsigned int pos = 0, avail, headerLen, packetLen;
+    char *packet, end;
+    cJSON *root;
+    int ret;
+
+    while (!client->readPaused)
+    {
+        packet = client->requestBuf + pos;
+        avail = client->reqBufPos - pos;
+        headerLen = packet_header_len(packet, avail);
+        if (avail < headerLen)
         {
             // We don't see the entire packet header, keep awaiting more data
-            return;
+            break;
         }
-
-        ret = packet_get_len(client->requestBuf, &client->packetLen);
-        if (ret != ERR_OK || client->packetLen >= SESSION_BUFFER_SIZE)
+        packet_get_len(packet, &packetLen);
+        if (packetLen > ((ServerT *)client->ourServer)->maxPacketLen)
         {
             // Packet data too long, close client session;
             session_close(&client);
-            return;
+            return ERR_UNKNOWN;
         }
-        client->reqBufPos = 0;
-    }
-    else
-    {
-        // Now get packet data
-        left = packetLen - pos;
-        ret = recvfrom(client->sock, &client->requestBuf[pos], left, 0, (struct sockaddr *)&fromAddr, &fromAddrLen);
-        if (ret <= 0)
+        if (headerLen == PACKET_HEADER_EXT_LEN)
         {
-            // Close client session;
-            session_close(&client);
-            return;
+            // The client reads extended headers as well
+            client->extFrames = 1;
         }
-        client->reqBufPos += (unsigned int)ret;
-        if (client->reqBufPos < packetLen)
+        if (avail - headerLen < packetLen)
         {
             // We don't see the entire packet, keep awaiting more data
-            return;
+            break;
         }
+        pos += headerLen + packetLen;
+        if (packetLen == 0) continue;
 
-        // We've got the whole packet data;
-        client->requestBuf[client->packetLen] = 0; // end the data string
-        root = cJSON_Parse(client->requestBuf);
+        // End the data string over the first byte of the next packet for a while
+        end = client->requestBuf[pos];
+        client->requestBuf[pos] = 0;
+        session_json_arena = reactor->jsonArena;
+        root = cJSON_Parse(packet + headerLen);
+        client->requestBuf[pos] = end;
+        ret = root ? session_dispatch(client, root) : ERR_UNKNOWN;
+        // Whatever the request and its response took goes at once
+        session_json_arena = NULL;
+        arena_reset(reactor->jsonArena);
         if (!root)
         {
             // Json data error
             session_close(&client);
-            return;
+            return ERR_UNKNOWN;
+        }
+        if (ret != ERR_OK || server_find_session(reactor, sid) != client)
+        {
+            // Closed, maybe by the service itself
+            return ERR_UNKNOWN;
         }
+    }
+
+    session_recv_compact(client, pos);
+    return ERR_OK;
+}
+
+// Serve one request, it owns "req". Returns an error if the session is closed.
+// A request with an "id" gets it back in its response, which may then come
+// before the responses of the requests sent earlier.
+// The request comes from the cJSON arena, so does the response if it is
+// served inline
+static int session_dispatch(SessionT *client, cJSON *root)
+{
+    unsigned int flags;
+    cJSON *res, *id, *req;
+    ArenaT *arena;
+    int ret, unordered, nested;
+
+    flags = service_get_flags(root);
+    if (!((ServerT *)client->ourServer)->workers)
+    {
+        // No worker pool on this platform, run it inline
+        flags &= ~SERVICE_FLAG_OFFLOAD;
+    }
+    // The service would walk a deeply nested request on the small stack of a coroutine
+    nested = ((flags & (SERVICE_FLAG_ASYNC | SERVICE_FLAG_OFFLOAD | SERVICE_FLAG_COROUTINE)) == SERVICE_FLAG_COROUTINE) && \
+             session_json_nested(root, SESSION_COROUTINE_NESTING);
+    if (!nested && (flags & (SERVICE_FLAG_ASYNC | SERVICE_FLAG_OFFLOAD | SERVICE_FLAG_COROUTINE)))
+    {
+        // The request outlives the arena, and so does anything the service
+        // builds in the meantime
+        arena = session_json_arena;
+        session_json_arena = NULL;
+        req = cJSON_Duplicate(root, 1);
+        session_json_arena = arena;
+        cJSON_Delete(root);
+        session_json_arena = NULL;
+        if (!req)
+        {
+            res = service_generate_response(SERVICE_RET_UNKNOWN);
+            ret = session_send_response(client, res, 0);
+            cJSON_Delete(res);
+            if (ret != ERR_OK)
+            {
+                session_close(&client);
+                return ERR_UNKNOWN;
+            }
+            return ERR_OK;
+        }
+        root = req;
+    }
+    id = cJSON_DetachItemFromObject(root, "id");
+    if (nested)
+    {
+        cJSON_Delete(root);
+        res = service_generate_response(SERVICE_RET_INVALID);
+    }
+    else if (flags & SERVICE_FLAG_ASYNC)
+    {
+        ret = session_async(client, root, id);
+        if (ret == ERR_OK)
+        {
+            // Later requests go on, their responses wait for this one
+            return ERR_OK;
+        }
+        cJSON_Delete(root);
+        res = service_generate_response(SERVICE_RET_BUSY);
+    }
+    else if (flags & (SERVICE_FLAG_OFFLOAD | SERVICE_FLAG_COROUTINE))
+    {
+        ret = (flags & SERVICE_FLAG_OFFLOAD) ? session_offload(client, root, id) : session_coroutine(client, root, id);
+        if (ret == ERR_OK)
+        {
+            // The response is sent once the service is done
+            return ERR_OK;
+        }
+        cJSON_Delete(root);
+        res = service_generate_response(SERVICE_RET_BUSY);
+    }
+    else
+    {
         res = service_invoke(root);
         cJSON_Delete(root);
-        session_send_response(client, res);
+    }
+    unordered = (id != NULL);
+    session_set_id(res, id);
+    ret = session_send_response(client, res, unordered);
+    cJSON_Delete(res);
+    if (ret != ERR_OK)
+    {
+        // The client doesn't keep up with its responses, or the socket is broken
+        session_close(&client);
+        return ERR_UNKNOWN;
+    }
+    return ERR_OK;
+}
+
+// Move the request id into the response, the id is freed if there is none
+static void session_set_id(cJSON *res, cJSON *id)
+{
+    if (!id) return;
+    if (!res)
+    {
+        cJSON_Delete(id);
+        return;
+    }
+    cJSON_AddItemToObject(res, "id", id);
+}
+
+// Print a response on the heap, it outlives the request being served inline:
+// an inline service may complete an async call, or run a coroutine
+static char *session_json_print(cJSON *res)
+{
+    ArenaT *arena = session_json_arena;
+    char *out;
+
+    session_json_arena = NULL;
+    out = cJSON_Print(res);
+    session_json_arena = arena;
+    return out;
+}
+
+// Whether arrays and objects are nested in "item" deeper than "limit", up to
+// SESSION_COROUTINE_NESTING. It doesn't recurse, "item" may be too deep for that
+static int session_json_nested(cJSON *item, int limit)
+{
+    cJSON *path[SESSION_COROUTINE_NESTING];
+    int depth = 0;
+
+    while (item)
+    {
+        if (item->child)
+        {
+            if (depth >= limit) return 1;
+            path[depth++] = item;
+            item = item->child;
+            continue;
+        }
+        // Up to the next sibling of the item or of its parents
+        while (depth > 0 && !item->next)
+        {
+            item = path[--depth];
+        }
+        item = (depth > 0) ? item->next : NULL;
+    }
+    return 0;
+}
+
+// The receive buffer is attached when the socket has data, and goes back to
+// the reactor pool once no packet is partly read, so idle sessions hold none
+static int session_recv_attach(SessionT *session)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+
+    session->requestBuf = pool_alloc(reactor->recvPool);
+    session->reqBufSize = SESSION_BUFFER_SIZE;
+    return session->requestBuf ? ERR_OK : ERR_MALLOC;
+}
+
+static void session_recv_release(SessionT *session)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+
+    if (session->reqBufSize == SESSION_BUFFER_SIZE)
+    {
+        pool_free(reactor->recvPool, session->requestBuf);
+    }
+    else
+    {
+        FREE(session->requestBuf);
+    }
+    session->requestBuf = NULL;
+    session->reqBufSize = 0;
+}
+
+// Make room for more of the long packet at the start of the buffer, the
+// buffer grows with the data received so an announced length alone doesn't
+// take the memory
+static int session_recv_grow(SessionT *session)
+{
+    unsigned int size, headerLen, packetLen;
+    char *buf;
+
+    headerLen = packet_header_len(session->requestBuf, session->reqBufPos);
+    packet_get_len(session->requestBuf, &packetLen);
+    if (packetLen + headerLen < session->reqBufSize)
+    {
+        // It is all there already
+        return ERR_OK;
+    }
+    size = session->reqBufSize * 4;
+    if (size > packetLen + headerLen || size < session->reqBufSize)
+    {
+        size = packetLen + headerLen + 1; // the packet and the end of its data
+    }
+    buf = MALLOC(size);
+    if (!buf) return ERR_MALLOC;
+    memcpy(buf, session->requestBuf, session->reqBufPos);
+    session_recv_release(session);
+    session->requestBuf = buf;
+    session->reqBufSize = size;
+
+    return ERR_OK;
+}
+
+// Drop the "pos" bytes served, a partly read packet moves to the start of
+// the buffer and a long buffer is given up once it isn't needed any more
+static void session_recv_compact(SessionT *session, unsigned int pos)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+    unsigned int left = session->reqBufPos - pos;
+    char *buf;
+
+    if (left == 0)
+    {
+        session->reqBufPos = 0;
+        session_recv_release(session);
+        return;
+    }
+    if (session->reqBufSize != SESSION_BUFFER_SIZE && left < SESSION_BUFFER_SIZE)
+    {
+        buf = pool_alloc(reactor->recvPool);
+        if (buf)
+        {
+            memcpy(buf, session->requestBuf + pos, left);
+            session_recv_release(session);
+            session->requestBuf = buf;
+            session->reqBufSize = SESSION_BUFFER_SIZE;
+            session->reqBufPos = left;
+            return;
+        }
+    }
+    if (pos > 0) memmove(session->requestBuf, session->requestBuf + pos, left);
+    session->reqBufPos = left;
+}
+
+// Serve the packets which came in while reading was paused, the socket may
+// have nothing more to tell
+static void session_recv_resume(SessionT *client)
+{
+    client->recvTask = SCHED_TASK_ID_INVALID;
+    if (client->requestBuf && !client->readPaused)
+    {
+        session_recv_parse(client);
+    }
+}
+
+// Hand a request to the worker pool, it owns "req" and "id" if this succeeds.
+// Reading the session stops until the response is queued, so the
+// responses keep the order of the requests. Unless the request has an id,
+// then reading goes on and the response is sent once it is ready.
+static int session_offload(SessionT *session, cJSON *req, cJSON *id)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+    ServerT *server = (ServerT *)session->ourServer;
+    SessionJobT *job;
+    int ret;
+
+    job = session_job_new(session, req, id);
+    if (!job) return ERR_UNKNOWN;
+    if (!job->unordered)
+    {
+        if (scheduler_suspend_read(reactor->scheduler, session->sock) != ERR_SCHEDULER_OK)
+        {
+            FREE(job);
+            return ERR_UNKNOWN;
+        }
+        session->readPaused = 1;
+    }
+    ret = worker_pool_submit(server->workers, (WorkerProcT)session_job_run, job, (WorkerProcT)session_job_cleanup);
+    if (ret != ERR_WORKER_OK)
+    {
+        DPRINTF("session %llx request not offloaded! %d\n", session->sid, ret);
+        session_job_abort(session, job);
+        return ERR_UNKNOWN;
+    }
+
+    return ERR_OK;
+}
+
+// A job for "req", NULL if the session has too many calls pending
+static SessionJobT *session_job_new(SessionT *session, cJSON *req, cJSON *id)
+{
+    SessionJobT *job;
+
+    if (id && session->asyncNum >= SESSION_ASYNC_MAX) return NULL;
+    job = MALLOC(sizeof(SessionJobT));
+    if (!job) return NULL;
+    MEMSET(job, 0, sizeof(SessionJobT));
+    job->reactor = (ReactorT *)session->ourReactor;
+    job->sid = session->sid;
+    job->req = req;
+    job->id = id;
+    job->unordered = (id != NULL);
+    // Calls with an id are pending along with the async ones
+    if (job->unordered) session->asyncNum++;
+
+    return job;
+}
+
+// Undo session_job_new() and what was done for the job, the caller keeps "req" and "id"
+static void session_job_abort(SessionT *session, SessionJobT *job)
+{
+    if (job->unordered)
+    {
+        session->asyncNum--;
+    }
+    else
+    {
+        scheduler_resume_read(job->reactor->scheduler, session->sock);
+        session->readPaused = 0;
+    }
+    FREE(job);
+}
+
+// Runs on a worker thread
+static void session_job_run(SessionJobT *job)
+{
+    cJSON *res;
+
+    res = service_invoke(job->req);
+    cJSON_Delete(job->req);
+    job->req = NULL;
+    session_set_id(res, job->id);
+    job->id = NULL;
+    if (res)
+    {
+        job->out = session_json_print(res);
         cJSON_Delete(res);
+    }
+}
 
-        client->reqBufPos = 0;
-        client->packetLen = 0;
+// Runs on a worker thread, or on the thread closing the pool when it drops the job without running it
+static void session_job_cleanup(SessionJobT *job)
+{
+    int ret;
+
+    if (job->req)
+    {
+        cJSON_Delete(job->req);
+        job->req = NULL;
+    }
+    ret = scheduler_delay_task_remote(job->reactor->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
+                                      (SchedProcT)session_job_done, job, (SchedProcT)session_job_free);
+    if (ret != ERR_SCHEDULER_OK)
+    {
+        session_job_free(job);
     }
 }
 
+// Back on the reactor owning the session
+static void session_job_done(SessionJobT *job)
+{
+    SessionT *session;
+    char *out;
+    int ret;
+
+    session = server_find_session(job->reactor, job->sid);
+    if (!session)
+    {
+        // Closed while the service was busy
+        return;
+    }
+    out = job->out;
+    job->out = NULL;
+    if (job->unordered)
+    {
+        // Nothing waits for it, nor does it wait for the others
+        if (job->reply)
+        {
+            list_remove(&job->reply->listEntry);
+            pool_free(job->reactor->replyPool, job->reply);
+            job->reply = NULL;
+        }
+        session->asyncNum--;
+        ret = out ? session_send(session, out, STRLEN(out)) : ERR_UNKNOWN;
+        if (out) FREE(out);
+        if (ret != ERR_OK)
+        {
+            session_close(&session);
+        }
+        return;
+    }
+    if (job->reply)
+    {
+        // An async call, its response slot is alive as long as the session is
+        job->reply->job = NULL;
+        job->reply->out = out;
+        session->asyncNum--;
+        if (session_reply_flush(session) != ERR_OK)
+        {
+            session_close(&session);
+        }
+        return;
+    }
+    if (session_reply(session, out) != ERR_OK || \
+        scheduler_resume_read(job->reactor->scheduler, session->sock) != ERR_SCHEDULER_OK)
+    {
+        session_close(&session);
+        return;
+    }
+    session->readPaused = 0;
+    if (session->requestBuf && session->recvTask == SCHED_TASK_ID_INVALID)
+    {
+        // More requests came with this one, they don't wait for the socket
+        session->recvTask = scheduler_delay_task(job->reactor->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
+                                                 (SchedProcT)session_recv_resume, session, NULL);
+        if (session->recvTask == SCHED_TASK_ID_INVALID)
+        {
+            session_close(&session);
+        }
+    }
+}
+
+static void session_job_free(SessionJobT *job)
+{
+    if (job->req) cJSON_Delete(job->req);
+    if (job->id) cJSON_Delete(job->id);
+    if (job->res) cJSON_Delete(job->res);
+    if (job->out) FREE(job->out);
+    FREE(job);
+}
+
+// Run a request in a coroutine of the reactor, it owns "req" and "id" if this
+// succeeds. Reading the session stops until the response is queued, unless
+// the request has an id, like session_offload().
+static int session_coroutine(SessionT *session, cJSON *req, cJSON *id)
+{
+    ReactorT *reactor = (ReactorT *)session->ourReactor;
+    SessionJobT *job;
+    int ret;
+
+    job = session_job_new(session, req, id);
+    if (!job) return ERR_UNKNOWN;
+    if (!job->unordered)
+    {
+        if (scheduler_suspend_read(reactor->scheduler, session->sock) != ERR_SCHEDULER_OK)
+        {
+            FREE(job);
+            return ERR_UNKNOWN;
+        }
+        session->readPaused = 1;
+    }
+    // The coroutine runs until the service suspends, or until it is done
+    ret = coroutine_start(reactor->scheduler, ((ServerT *)session->ourServer)->coroutineStackSize, \
+                          (SchedProcT)session_coroutine_run, job, (SchedProcT)session_coroutine_done);
+    if (ret == ERR_COROUTINE_UNSUPPORTED)
+    {
+        // No coroutines on this platform, run it inline
+        session_coroutine_run(job);
+        session_coroutine_done(job);
+        return ERR_OK;
+    }
+    if (ret != ERR_COROUTINE_OK)
+    {
+        DPRINTF("session %llx request not started! %d\n", session->sid, ret);
+        session_job_abort(session, job);
+        return ERR_UNKNOWN;
+    }
+
+    return ERR_OK;
+}
+
+// Runs in the coroutine. cJSON frees and prints recursively, that is left to
+// session_coroutine_done() which runs off the coroutine stack
+static void session_coroutine_run(SessionJobT *job)
+{
+    job->res = service_invoke(job->req);
+}
+
+static void session_coroutine_done(SessionJobT *job)
+{
+    cJSON_Delete(job->req);
+    job->req = NULL;
+    session_set_id(job->res, job->id);
+    job->id = NULL;
+    if (job->res)
+    {
+        job->out = session_json_print(job->res);
+        cJSON_Delete(job->res);
+        job->res = NULL;
+    }
+    session_job_done(job);
+    session_job_free(job);
+}
+
+// Hand a request to an async service, it owns "req" and "id" if this succeeds.
+// Reading the session goes on, a response slot keeps the order of the
+// responses. The slot of a request with an id is only kept for closing the
+// session, its response goes out once it is ready.
+static int session_async(SessionT *session, cJSON *req, cJSON *id)
+{
+    SessionJobT *job;
+    SessionReplyT *reply;
+
+    if (session->asyncNum >= SESSION_ASYNC_MAX || (!id && session->replyNum >= SESSION_REPLYQ_MAX))
+    {
+        return ERR_UNKNOWN;
+    }
+    job = MALLOC(sizeof(SessionJobT));
+    if (!job) return ERR_MALLOC;
+    reply = pool_alloc(((ReactorT *)session->ourReactor)->replyPool);
+    if (!reply)
+    {
+        FREE(job);
+        return ERR_MALLOC;
+    }
+    MEMSET(job, 0, sizeof(SessionJobT));
+    job->call.complete = session_async_complete;
+    job->reactor = (ReactorT *)session->ourReactor;
+    job->sid = session->sid;
+    job->req = req;
+    job->id = id;
+    job->unordered = (id != NULL);
+    job->reply = reply;
+    job->state = SESSION_CALL_PENDING;
+    reply->job = job;
+    reply->out = NULL;
+    if (job->unordered)
+    {
+        list_insert_before(&session->callList, &reply->listEntry);
+    }
+    else
+    {
+        list_insert_before(&session->replyQ, &reply->listEntry);
+        session->replyNum++;
+    }
+    session->asyncNum++;
+
+    // The service may complete the call right away, the response is posted all the same
+    service_invoke_async(req, &job->call);
+    return ERR_OK;
+}
+
+// Called by service_complete(), on any thread
+static void session_async_complete(ServiceCallT *call, cJSON *res)
+{
+    SessionJobT *job = list_entry(call, SessionJobT, call);
+    int ret = ERR_SCHEDULER_UNKNOWN;
+
+    session_set_id(res, job->id);
+    job->id = NULL;
+    if (res)
+    {
+        job->out = session_json_print(res);
+        cJSON_Delete(res);
+    }
+    cJSON_Delete(job->req);
+    job->req = NULL;
+
+    SESSION_CALL_LOCK();
+    if (job->state == SESSION_CALL_PENDING)
+    {
+        // The session can't close while we hold the lock, nor can its reactor
+        job->state = SESSION_CALL_POSTED;
+        ret = scheduler_delay_task_remote(job->reactor->scheduler, 0, DELAYTASK_FLAG_ONESHOT, \
+                                          (SchedProcT)session_job_done, job, (SchedProcT)session_job_free);
+    }
+    SESSION_CALL_UNLOCK();
+
+    if (ret != ERR_SCHEDULER_OK)
+    {
+        // Detached, or the reactor is closing
+        session_job_free(job);
+    }
+}
+
+// The session of a pending async call is closing, on its reactor
+static void session_async_detach(SessionJobT *job)
+{
+    SESSION_CALL_LOCK();
+    if (job->state == SESSION_CALL_PENDING)
+    {
+        job->state = SESSION_CALL_DETACHED;
+    }
+    // Once posted, session_job_done() doesn't find the session and drops the response
+    SESSION_CALL_UNLOCK();
+}
+
+// Length of the header starting with the "got" bytes in "header"
+static unsigned int packet_header_len(char *header, unsigned int got)
+{
+    unsigned short dataLen;
+
+    if (got < PACKET_HEADER_LEN) return PACKET_HEADER_LEN;
+    memcpy(&dataLen, header, sizeof(dataLen));
+
+    return ntohs(dataLen) == PACKET_LEN_ESCAPE ? PACKET_HEADER_EXT_LEN : PACKET_HEADER_LEN;
+}
+
 static int packet_get_len(char *header, unsigned int *len)
 {
     unsigned short dataLen;
+    unsigned int extLen;
 
-    dataLen = *(unsigned short *)header;
+    memcpy(&dataLen, header, sizeof(dataLen));
     dataLen = ntohs(dataLen);
+    if (dataLen == PACKET_LEN_ESCAPE)
+    {
+        memcpy(&extLen, header + PACKET_HEADER_LEN, sizeof(extLen));
+        *len = ntohl(extLen);
+        return ERR_OK;
+    }
 
     *len = dataLen;
     return ERR_OK;
 }
 
+// Write the header of a "len" bytes packet, returns the header length
+static unsigned int packet_put_header(char *header, unsigned int len, int ext)
+{
+    unsigned short dataLen;
+    unsigned int extLen;
+
+    if (!ext)
+    {
+        dataLen = htons((unsigned short)len);
+        memcpy(header, &dataLen, sizeof(dataLen));
+        return PACKET_HEADER_LEN;
+    }
+    dataLen = htons(PACKET_LEN_ESCAPE);
+    extLen = htonl(len);
+    memcpy(header, &dataLen, sizeof(dataLen));
+    memcpy(header + PACKET_HEADER_LEN, &extLen, sizeof(extLen));
+    return PACKET_HEADER_EXT_LEN;
+}
+
@@ -1,18 +1,65 @@
 #ifndef __NET_SESSION_H__
 #define __NET_SESSION_H__
 
+// Packet framing: a 2-byte big-endian length and the data. A length of
+// PACKET_LEN_ESCAPE is followed by a 4-byte big-endian length instead, for
+// packets of 64KB and more. A client sending such an extended header tells it
+// reads them as well, then a long response is framed the same way; the others
+// only ever get 2-byte headers.
+// The data is a JSON request or response, see format.txt
 #define PACKET_HEADER_LEN   2
-#define SESSION_BUFFER_SIZE 1024
+#define PACKET_HEADER_EXT_LEN 6 // the escape and the 4-byte length
+#define PACKET_LEN_ESCAPE   0xffff
+#define SESSION_BUFFER_SIZE 4096 // receive buffer from the reactor pool, longer packets get a growing one
+#define SESSION_PACKET_MAX  (16*1024*1024) // max request length, unless ServerParamT says otherwise
+#define SESSION_SENDQ_MAX   (1024*1024) // max bytes waiting in the output queue
+#define SESSION_IOV_MAX     64 // queued packets written by one sendmsg()
+#define SESSION_ASYNC_MAX   256 // max async calls and calls with an id pending, more get SERVICE_RET_BUSY
+#define SESSION_REPLYQ_MAX  256 // max responses waiting for a pending async call
+#define SESSION_POOL_BUF_LEN 512 // packets up to this long are queued in buffers of the reactor pool
+#define SESSION_ARENA_SIZE  (16*1024) // cJSON arena of a reactor to start with
+#define SESSION_ARENA_MAX   (1024*1024) // the arena grows up to this size when a request doesn't fit
+#define SESSION_COROUTINE_NESTING 64 // requests nested deeper get SERVICE_RET_INVALID instead of a coroutine
+
+// A framed packet waiting in the output queue
+typedef struct _SessionBufT {
+	ListNodeT listEntry;
+	unsigned int len;
+	unsigned int pos; // bytes already sent
+	char data[1];
+} SessionBufT;
+
+// Identifies a session: generation and slot in the session table of its reactor, and the reactor
+typedef unsigned long long SessionIdT;
+#define SESSION_ID_INVALID  0
+
+// A response slot, keeps the responses in request order while async calls are pending
+typedef struct _SessionReplyT {
+	ListNodeT listEntry;
+	void *job; // the pending async call, NULL once it is answered
+	char *out; // the response, NULL until it is answered
+} SessionReplyT;
 
 typedef struct _SessionT {
 	int sock;
-	int sid;
-	ListNodeT listEntry;
+	SessionIdT sid;
+	int slot; // in the session table of the reactor
 	void *ourServer;
-	unsigned int reqBufPos;
-	unsigned int packetLen;
-	char requestBuf[SESSION_BUFFER_SIZE];
-    char *response;
+	void *ourReactor; // the reactor this session lives on
+	unsigned int reqBufPos; // bytes in requestBuf, one or more packets, the last one maybe partly read
+	char *requestBuf; // NULL while no packet is partly read
+	unsigned int reqBufSize; // SESSION_BUFFER_SIZE if requestBuf is from the reactor pool
+	int extFrames; // bool var, the client uses extended headers
+	int readPaused; // bool var, a call stopped reading until its response is queued
+	unsigned long long recvTask; // serves the packets left in requestBuf once reading goes on, 0 if none
+	ListNodeT sendQ; // SessionBufT list
+	unsigned int sendQBytes;
+	int writeArmed; // bool var, waiting for the socket to become writable
+	unsigned long long flushTask; // sends the packets queued in this scheduler step, 0 if none
+	ListNodeT replyQ; // SessionReplyT list, empty unless an async call is pending
+	ListNodeT callList; // SessionReplyT of the async calls with an id, answered in any order
+	unsigned int replyNum; // in replyQ
+	unsigned int asyncNum; // async calls and calls with an id pending
 } SessionT;
 
 
@@ -21,7 +68,8 @@ extern "C" {
 #endif
 
 
-int session_open(SessionT **pClient, void *ourServer, int sock);
+int session_init(void);
+int session_open(SessionT **pClient, void *ourReactor, int sock);
 int session_close(SessionT **pClient);
 
 
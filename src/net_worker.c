@@ -0,0 +1,562 @@
+
+#if defined(LINUX_ENV) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sched_setaffinity()
+#endif
+#include "net_worker.h"
+
+#if defined(LINUX_ENV)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#define WORKER_PRINTF printf
+#define MALLOC malloc
+#define FREE free
+#define MEMSET	memset
+#elif defined(PLATFORM_RT_THREAD)
+#include <rtthread.h>
+#define WORKER_PRINTF rt_kprintf
+#define MALLOC UT_MALLOC
+#define FREE UT_FREE
+#define MEMSET UT_MEMSET
+#endif
+
+struct _WorkerTaskT
+{
+    struct _WorkerTaskT *next; // injection queue link
+    WorkerProcT proc;
+    void *clientData;
+    WorkerProcT cleanUp;
+    int joinable; // bool var, spawned task freed by worker_join()
+    int done; // bool var, set once proc has returned
+};
+
+#if defined(LINUX_ENV)
+
+#define WORKER_DEQUE_SIZE   4096 // must be a power of 2
+#define WORKER_STEAL_TRIES  4 // rounds over the other workers before going to sleep
+#define WORKER_CACHE_LINE   64
+
+// Chase-Lev work-stealing deque, the owner pushes and takes at the bottom,
+// the other workers steal at the top
+typedef struct _WorkerDequeT
+{
+    long top __attribute__((aligned(WORKER_CACHE_LINE)));
+    long bottom __attribute__((aligned(WORKER_CACHE_LINE)));
+    WorkerTaskT *tasks[WORKER_DEQUE_SIZE];
+} WorkerDequeT;
+
+typedef struct _WorkerT
+{
+    WorkerDequeT deque;
+    WorkerPoolT *pool;
+    pthread_t thread;
+    unsigned int seed; // picks the victims to steal from
+    int cpu; // the CPU the worker is pinned to, -1 if it isn't
+} __attribute__((aligned(WORKER_CACHE_LINE))) WorkerT;
+
+struct _WorkerPoolT
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when there is work or the pool is closing
+    // Jobs submitted from outside of the pool
+    WorkerTaskT *jobHead;
+    WorkerTaskT *jobTail;
+    int jobNum;
+    int queueMax;
+    int idleNum; // workers sleeping on "cond"
+    int stopping; // bool var
+    WorkerT *workers;
+    int threadNum;
+};
+
+// The worker the current thread is, NULL outside of the pools
+static __thread WorkerT *worker_self = NULL;
+
+static void *WorkerThread(void *data);
+static int DequePush(WorkerDequeT *dq, WorkerTaskT *task);
+static WorkerTaskT* DequeTake(WorkerDequeT *dq);
+static WorkerTaskT* DequeSteal(WorkerDequeT *dq);
+static int DequeEmpty(WorkerDequeT *dq);
+static WorkerTaskT* StealTask(WorkerT *worker);
+static WorkerTaskT* PopJob(WorkerPoolT *pool);
+static void RunTask(WorkerTaskT *task);
+static void WakeWorker(WorkerPoolT *pool);
+static int BindCpu(int cpu);
+
+/**
+ * @brief Create a pool of worker threads
+ * Jobs submitted to the pool run on the first idle thread, the subtasks they
+ * spawn are shared out by work stealing.
+ *
+ * @param [out] pPool get a worker pool
+ * @param [in] param parameters for the pool, NULL for the defaults
+ * @return status code
+ */
+int worker_pool_open(WorkerPoolT **pPool, WorkerParamT *param)
+{
+    WorkerPoolT *pool;
+    int i, threadNum;
+
+    pool = (WorkerPoolT *)MALLOC(sizeof(WorkerPoolT));
+    if (pool == NULL)
+    {
+        return ERR_WORKER_UNKNOWN;
+    }
+    MEMSET(pool, 0, sizeof(WorkerPoolT));
+    threadNum = WORKER_DEFAULT_THREADS;
+    pool->queueMax = WORKER_DEFAULT_QUEUE_MAX;
+    if (param != NULL)
+    {
+        if (param->threadNum > 0) threadNum = param->threadNum;
+        if (param->queueMax > 0) pool->queueMax = param->queueMax;
+    }
+
+    if (posix_memalign((void **)&pool->workers, WORKER_CACHE_LINE, threadNum * sizeof(WorkerT)) != 0)
+    {
+        FREE(pool);
+        return ERR_WORKER_UNKNOWN;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    // The deque slots are left alone, each worker writes its own first, so a
+    // pinned worker gets them from its local NUMA node
+    pool->threadNum = threadNum;
+    for (i = 0; i < threadNum; i++)
+    {
+        pool->workers[i].deque.top = 0;
+        pool->workers[i].deque.bottom = 0;
+        pool->workers[i].pool = pool;
+        pool->workers[i].seed = i * 2654435761u + 1;
+        pool->workers[i].cpu = -1;
+        if (param != NULL && param->cpus != NULL && param->cpuNum > 0)
+        {
+            pool->workers[i].cpu = param->cpus[i % param->cpuNum];
+        }
+    }
+    for (i = 0; i < threadNum; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, WorkerThread, &pool->workers[i]) != 0)
+        {
+            WORKER_PRINTF("[Worker] pthread_create() failed!\n");
+            pthread_mutex_lock(&pool->lock);
+            __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            while (--i >= 0) pthread_join(pool->workers[i].thread, NULL);
+            pthread_cond_destroy(&pool->cond);
+            pthread_mutex_destroy(&pool->lock);
+            FREE(pool->workers);
+            FREE(pool);
+            return ERR_WORKER_UNKNOWN;
+        }
+    }
+
+    *pPool = pool;
+    return ERR_WORKER_OK;
+}
+
+/**
+ * @brief Destroy a worker pool
+ * The jobs already running are waited for, the ones still queued don't run but
+ * their Cleanup functions are called, on the thread calling this function.
+ *
+ * @param [in, out] pPool [in] a pool get from worker_pool_open(), [out] should be set to NULL if succeed
+ * @return status code
+ */
+int worker_pool_close(WorkerPoolT **pPool)
+{
+    WorkerPoolT *pool = *pPool;
+    WorkerTaskT *job;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threadNum; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    while ((job = pool->jobHead) != NULL)
+    {
+        pool->jobHead = job->next;
+        if (job->cleanUp) (*job->cleanUp)(job->clientData);
+        FREE(job);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    FREE(pool->workers);
+    FREE(pool);
+    *pPool = NULL;
+
+    return ERR_WORKER_OK;
+}
+
+/**
+ * @brief Queue a job for the worker threads, can be called from any thread
+ * The Cleanup function is called on the worker thread once the job function
+ * returns, or on the thread calling worker_pool_close() if the pool is closed
+ * before the job could run.
+ *
+ * @param [in] pool the pool get from worker_pool_open()
+ * @param [in] proc the job function
+ * @param [in] clientData specific data passed to the job function and Cleanup function
+ * @param [in] cleanUp the Cleanup function for doing cleanup job
+ * @return status code, ERR_WORKER_BUSY if the queue is full
+ */
+int worker_pool_submit(WorkerPoolT *pool, WorkerProcT proc, void *clientData, WorkerProcT cleanUp)
+{
+    WorkerTaskT *job;
+
+    job = (WorkerTaskT *)MALLOC(sizeof(WorkerTaskT));
+    if (job == NULL)
+    {
+        return ERR_WORKER_UNKNOWN;
+    }
+    job->next = NULL;
+    job->proc = proc;
+    job->clientData = clientData;
+    job->cleanUp = cleanUp;
+    job->joinable = 0;
+    job->done = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping || pool->jobNum >= pool->queueMax)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        FREE(job);
+        return ERR_WORKER_BUSY;
+    }
+    if (pool->jobTail) pool->jobTail->next = job;
+    else pool->jobHead = job;
+    pool->jobTail = job;
+    __atomic_add_fetch(&pool->jobNum, 1, __ATOMIC_RELAXED);
+    if (pool->idleNum > 0) pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return ERR_WORKER_OK;
+}
+
+/**
+ * @brief Start a subtask that the caller will wait for with worker_join()
+ * Called from a job running on a pool, e.g. an offloaded service, the subtask
+ * goes on the deque of the calling worker, where idle workers steal it from.
+ * Called from any other thread, the subtask runs right away.
+ *
+ * @param [out] pTask get the subtask to join
+ * @param [in] proc the subtask function
+ * @param [in] clientData specific data passed to the subtask function
+ * @return status code
+ */
+int worker_spawn(WorkerTaskT **pTask, WorkerProcT proc, void *clientData)
+{
+    WorkerT *worker = worker_self;
+    WorkerTaskT *task;
+
+    task = (WorkerTaskT *)MALLOC(sizeof(WorkerTaskT));
+    if (task == NULL)
+    {
+        return ERR_WORKER_UNKNOWN;
+    }
+    task->next = NULL;
+    task->proc = proc;
+    task->clientData = clientData;
+    task->cleanUp = NULL;
+    task->joinable = 1;
+    task->done = 0;
+
+    if (worker == NULL || DequePush(&worker->deque, task) != ERR_WORKER_OK)
+    {
+        // Not on a pool, or the deque is full: do it now
+        RunTask(task);
+    }
+    else
+    {
+        WakeWorker(worker->pool);
+    }
+
+    *pTask = task;
+    return ERR_WORKER_OK;
+}
+
+/**
+ * @brief Wait for a subtask started by worker_spawn(), and release it
+ * The calling worker runs other subtasks while it is waiting.
+ *
+ * @param [in] task the subtask get from worker_spawn()
+ * @return status code
+ */
+int worker_join(WorkerTaskT *task)
+{
+    WorkerT *worker = worker_self;
+    WorkerTaskT *other;
+
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+    {
+        // Our own subtasks first, they are the most likely to be the one we wait for
+        other = worker ? DequeTake(&worker->deque) : NULL;
+        if (other == NULL && worker) other = StealTask(worker);
+        if (other != NULL)
+        {
+            RunTask(other);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+
+    FREE(task);
+    return ERR_WORKER_OK;
+}
+
+static void *WorkerThread(void *data)
+{
+    WorkerT *worker = (WorkerT *)data;
+    WorkerPoolT *pool = worker->pool;
+    WorkerTaskT *task;
+    int i, busy;
+
+    worker_self = worker;
+    if (worker->cpu >= 0 && BindCpu(worker->cpu) != 0)
+    {
+        WORKER_PRINTF("[Worker] can't bind to CPU %d\n", worker->cpu);
+    }
+    while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+    {
+        task = DequeTake(&worker->deque);
+        if (task == NULL) task = PopJob(pool);
+        if (task == NULL) task = StealTask(worker);
+        if (task != NULL)
+        {
+            RunTask(task);
+            continue;
+        }
+
+        // Nothing to do, go to sleep unless work shows up while we register as idle
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->idleNum, 1, __ATOMIC_SEQ_CST);
+        busy = (pool->jobHead != NULL);
+        for (i = 0; i < pool->threadNum && !busy; i++)
+        {
+            busy = !DequeEmpty(&pool->workers[i].deque);
+        }
+        if (!busy && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->idleNum, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    worker_self = NULL;
+
+    return NULL;
+}
+
+static WorkerTaskT* PopJob(WorkerPoolT *pool)
+{
+    WorkerTaskT *job;
+
+    if (__atomic_load_n(&pool->jobNum, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    job = pool->jobHead;
+    if (job != NULL)
+    {
+        pool->jobHead = job->next;
+        if (pool->jobHead == NULL) pool->jobTail = NULL;
+        __atomic_sub_fetch(&pool->jobNum, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+static WorkerTaskT* StealTask(WorkerT *worker)
+{
+    WorkerPoolT *pool = worker->pool;
+    WorkerTaskT *task;
+    int i, round, victim;
+
+    if (pool->threadNum < 2)
+    {
+        return NULL;
+    }
+
+    for (round = 0; round < WORKER_STEAL_TRIES; round++)
+    {
+        // Start at a random worker so the thieves spread over the victims
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        victim = worker->seed % pool->threadNum;
+        for (i = 0; i < pool->threadNum; i++, victim = (victim + 1) % pool->threadNum)
+        {
+            if (&pool->workers[victim] == worker) continue;
+            task = DequeSteal(&pool->workers[victim].deque);
+            if (task != NULL) return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void RunTask(WorkerTaskT *task)
+{
+    if (task->proc) (*task->proc)(task->clientData);
+    if (task->joinable)
+    {
+        // worker_join() frees it
+        __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    if (task->cleanUp) (*task->cleanUp)(task->clientData);
+    FREE(task);
+}
+
+// A subtask has been pushed, make sure a sleeping worker comes to steal it
+static void WakeWorker(WorkerPoolT *pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idleNum, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Owner only
+static int DequePush(WorkerDequeT *dq, WorkerTaskT *task)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= WORKER_DEQUE_SIZE)
+    {
+        return ERR_WORKER_BUSY;
+    }
+    __atomic_store_n(&dq->tasks[b & (WORKER_DEQUE_SIZE-1)], task, __ATOMIC_RELAXED);
+    // Publishes the task to the thieves reading "bottom"
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+    return ERR_WORKER_OK;
+}
+
+// Owner only, takes the newest task
+static WorkerTaskT* DequeTake(WorkerDequeT *dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    WorkerTaskT *task;
+
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+    if (t > b)
+    {
+        // Empty
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    task = __atomic_load_n(&dq->tasks[b & (WORKER_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        // Last one, race the thieves for it
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL;
+        }
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any thread, takes the oldest task
+static WorkerTaskT* DequeSteal(WorkerDequeT *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    long b;
+    WorkerTaskT *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+    {
+        return NULL;
+    }
+
+    task = __atomic_load_n(&dq->tasks[t & (WORKER_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        // Lost the race to another thief or the owner
+        return NULL;
+    }
+    return task;
+}
+
+static int DequeEmpty(WorkerDequeT *dq)
+{
+    return __atomic_load_n(&dq->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&dq->bottom, __ATOMIC_SEQ_CST);
+}
+
+// Pin the calling thread to one CPU
+static int BindCpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu >= CPU_SETSIZE) return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+#else
+
+// No threads on this platform, callers run the jobs themselves
+int worker_pool_open(WorkerPoolT **pPool, WorkerParamT *param)
+{
+    return ERR_WORKER_UNSUPPORTED;
+}
+
+int worker_pool_close(WorkerPoolT **pPool)
+{
+    return ERR_WORKER_UNSUPPORTED;
+}
+
+int worker_pool_submit(WorkerPoolT *pool, WorkerProcT proc, void *clientData, WorkerProcT cleanUp)
+{
+    return ERR_WORKER_UNSUPPORTED;
+}
+
+int worker_spawn(WorkerTaskT **pTask, WorkerProcT proc, void *clientData)
+{
+    WorkerTaskT *task;
+
+    task = (WorkerTaskT *)MALLOC(sizeof(WorkerTaskT));
+    if (task == NULL)
+    {
+        return ERR_WORKER_UNKNOWN;
+    }
+    if (proc) (*proc)(clientData);
+    task->done = 1;
+    *pTask = task;
+    return ERR_WORKER_OK;
+}
+
+int worker_join(WorkerTaskT *task)
+{
+    FREE(task);
+    return ERR_WORKER_OK;
+}
+
+#endif // LINUX_ENV
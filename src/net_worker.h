@@ -0,0 +1,44 @@
+
+#ifndef __NET_WORKER_H__
+#define __NET_WORKER_H__
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*WorkerProcT)(void* clientData);
+
+typedef struct _WorkerPoolT WorkerPoolT;
+typedef struct _WorkerTaskT WorkerTaskT;
+typedef struct _WorkerParamT
+{
+    int threadNum; // number of worker threads, 0 for WORKER_DEFAULT_THREADS
+    int queueMax; // max jobs waiting for a thread, 0 for WORKER_DEFAULT_QUEUE_MAX
+    const int *cpus; // worker i is pinned to cpus[i % cpuNum], NULL to leave them to the OS
+    int cpuNum;
+} WorkerParamT;
+
+#define WORKER_DEFAULT_THREADS      4
+#define WORKER_DEFAULT_QUEUE_MAX    1024
+
+// Worker Pool Interfaces:
+int worker_pool_open(WorkerPoolT **pPool, WorkerParamT *param);
+int worker_pool_close(WorkerPoolT **pPool);
+int worker_pool_submit(WorkerPoolT *pool, WorkerProcT proc, void *clientData, WorkerProcT cleanUp);
+
+// Subtask Interfaces, for jobs fanning out on the pool they run on:
+int worker_spawn(WorkerTaskT **pTask, WorkerProcT proc, void *clientData);
+int worker_join(WorkerTaskT *task);
+
+// Error code
+#define ERR_WORKER_OK		(0)
+#define ERR_WORKER_UNKNOWN		(-300)
+#define ERR_WORKER_BUSY		(-301)
+#define ERR_WORKER_UNSUPPORTED		(-302)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __NET_WORKER_H__
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "net_arena.h"
+#include "test_util.h"
+
+// Objects of an arena don't overlap and are aligned like malloc() does, a
+// reset releases all of them, and a block too small for what was asked since
+// the last reset is doubled at the next one, up to the max size.
+
+#define BLOCK_SIZE 1024
+#define BLOCK_MAX (BLOCK_SIZE * 4)
+
+static int test_alloc_reset(void)
+{
+    ArenaStatsT stats;
+    ArenaT *arena;
+    unsigned char *objs[64], *first;
+    unsigned int i, j;
+    int local;
+
+    TEST_CHECK(arena_open(&arena, BLOCK_SIZE, BLOCK_MAX) == ERR_ARENA_OK);
+
+    // Odd sizes, each one starts aligned
+    for (i = 0; i < 16; i++)
+    {
+        objs[i] = arena_alloc(arena, i * 3 + 1);
+        TEST_CHECK(objs[i] != NULL);
+        TEST_CHECK(((unsigned long)objs[i] & 15) == 0);
+        TEST_CHECK(arena_owns(arena, objs[i]));
+        memset(objs[i], (unsigned char)i, i * 3 + 1);
+    }
+    for (i = 0; i < 16; i++)
+    {
+        for (j = 0; j < i * 3 + 1; j++)
+        {
+            TEST_CHECK(objs[i][j] == (unsigned char)i);
+        }
+    }
+    TEST_CHECK(!arena_owns(arena, &local));
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == BLOCK_SIZE && stats.used > 0 && stats.used == stats.peak);
+    TEST_CHECK(stats.overflowNum == 0 && stats.growNum == 0);
+
+    // A reset hands out the same memory again, the peak stays
+    arena_reset(arena);
+    first = arena_alloc(arena, 1);
+    TEST_CHECK(first == objs[0]);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.used == 16 && stats.peak > stats.used && stats.resetNum == 1);
+    TEST_CHECK(arena_get_stats(arena, NULL) == ERR_ARENA_UNKNOWN);
+
+    TEST_CHECK(arena_close(&arena) == ERR_ARENA_OK && arena == NULL);
+    return 0;
+}
+
+static int test_grow(void)
+{
+    ArenaStatsT stats;
+    ArenaT *arena;
+    void *obj;
+    int i;
+
+    TEST_CHECK(arena_open(&arena, BLOCK_SIZE, BLOCK_MAX) == ERR_ARENA_OK);
+
+    // Full, the rest is up to the caller, the block stays until the reset
+    TEST_CHECK(arena_alloc(arena, BLOCK_SIZE) != NULL);
+    TEST_CHECK(arena_alloc(arena, 1) == NULL);
+    TEST_CHECK(arena_alloc(arena, BLOCK_SIZE * 2) == NULL);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == BLOCK_SIZE && stats.overflowNum == 2 && stats.growNum == 0);
+
+    // Doubled on each reset after an overflow, never beyond the max
+    for (i = 0; i < 4; i++)
+    {
+        arena_reset(arena);
+        TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+        obj = arena_alloc(arena, stats.size + 1);
+        TEST_CHECK(obj == NULL);
+    }
+    arena_reset(arena);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == BLOCK_MAX && stats.growNum == 2 && stats.used == 0);
+    obj = arena_alloc(arena, BLOCK_MAX);
+    TEST_CHECK(obj != NULL && arena_owns(arena, obj));
+
+    // No overflow, no growth
+    arena_reset(arena);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == BLOCK_MAX && stats.growNum == 2);
+
+    TEST_CHECK(arena_close(&arena) == ERR_ARENA_OK);
+    return 0;
+}
+
+static int test_open(void)
+{
+    ArenaStatsT stats;
+    ArenaT *arena;
+
+    TEST_CHECK(arena_open(&arena, 0, BLOCK_MAX) == ERR_ARENA_UNKNOWN);
+
+    // Sizes are rounded up, a max below the size is the size
+    TEST_CHECK(arena_open(&arena, 100, 10) == ERR_ARENA_OK);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == 112);
+    TEST_CHECK(arena_alloc(arena, 113) == NULL);
+    arena_reset(arena);
+    TEST_CHECK(arena_get_stats(arena, &stats) == ERR_ARENA_OK);
+    TEST_CHECK(stats.size == 112 && stats.growNum == 0);
+    TEST_CHECK(arena_close(&arena) == ERR_ARENA_OK);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    ret = test_alloc_reset();
+    if (ret == 0) ret = test_grow();
+    if (ret == 0) ret = test_open();
+
+    printf("arena: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
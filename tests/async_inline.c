@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// An inline service completes a pending async call on the reactor thread,
+// while the cJSON arena of the reactor serves the inline request. The
+// response of the async call must not come from the arena: the arena is
+// reset before the response is sent and freed.
+
+#define TEST_PORT 6100
+
+static ServiceCallT *pendingCall;
+
+// Async, completed by "pub"
+void service_sub(cJSON *params, ServiceCallT *call)
+{
+    pendingCall = call;
+}
+
+// Inline, completes the pending "sub" call with a response built in the arena
+cJSON *service_pub(cJSON *params)
+{
+    cJSON *res, *value;
+
+    if (pendingCall)
+    {
+        value = cJSON_GetObjectItem(params, "value");
+        res = cJSON_CreateObject();
+        cJSON_AddStringToObject(res, "sub", value ? value->valuestring : "");
+        service_complete(pendingCall, res);
+        pendingCall = NULL;
+    }
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "pub", "done");
+    return res;
+}
+
+static int test_inline_complete(void)
+{
+    char buf[1024], filler[512];
+    unsigned int len = 0;
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    if (sock < 0) return -1;
+
+    // One read gets all of them: the last request reuses the arena the
+    // "sub" response would be in before that response is sent
+    memset(filler, 'x', sizeof(filler) - 1);
+    filler[sizeof(filler) - 1] = 0;
+    len += test_put_call(buf + len, "sub", "");
+    len += test_put_call(buf + len, "pub", "published");
+    len += test_put_call(buf + len, "pub", filler);
+    send(sock, buf, len, 0);
+
+    // Responses keep the order of their requests
+    ret = test_expect(sock, "sub", "published");
+    if (ret == 0) ret = test_expect(sock, "pub", "done");
+    if (ret == 0) ret = test_expect(sock, "pub", "done");
+
+    close(sock);
+    return ret;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register_async("sub", &service_sub, NULL);
+    service_register("pub", &service_pub, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_inline_complete();
+
+    test_server_close(&server, thread);
+
+    printf("async_inline: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// The responses to the requests served in one scheduler step are corked in
+// the output queue, and gathered into one sendmsg() of up to
+// SESSION_IOV_MAX packets. What a full socket doesn't take goes out once it
+// is writable again, from where it stopped.
+
+#define TEST_PORT 6105
+#define BATCH_NUM 50
+#define BLOB_NUM 12
+#define BLOB_LEN 60000
+#define CHUNK_LEN 4096
+
+// Only the server calls sendmsg(), the client sends with send()
+static int sendCalls;
+static int sendPackets;
+static int maxIovLen;
+// When set, every other call fails with EAGAIN and the others write at most
+// CHUNK_LEN bytes, as a full socket would
+static int socketFull;
+static int shortWrites;
+
+ssize_t sendmsg(int sock, const struct msghdr *msg, int flags)
+{
+    int iovLen = (int)msg->msg_iovlen, max, calls;
+    struct msghdr chunkMsg;
+    struct iovec chunk;
+
+    calls = __atomic_add_fetch(&sendCalls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sendPackets, iovLen, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&maxIovLen, __ATOMIC_RELAXED);
+    if (iovLen > max) __atomic_store_n(&maxIovLen, iovLen, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&socketFull, __ATOMIC_RELAXED) || iovLen == 0)
+    {
+        return syscall(SYS_sendmsg, sock, msg, flags);
+    }
+
+    __atomic_add_fetch(&shortWrites, 1, __ATOMIC_RELAXED);
+    if (calls % 2)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    chunk = msg->msg_iov[0];
+    if (chunk.iov_len > CHUNK_LEN) chunk.iov_len = CHUNK_LEN;
+    chunkMsg = *msg;
+    chunkMsg.msg_iov = &chunk;
+    chunkMsg.msg_iovlen = 1;
+    return syscall(SYS_sendmsg, sock, &chunkMsg, flags);
+}
+
+static void reset_counts(void)
+{
+    __atomic_store_n(&sendCalls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sendPackets, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&maxIovLen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shortWrites, 0, __ATOMIC_RELAXED);
+}
+
+// Sends back its "value"
+cJSON *service_echo(cJSON *params)
+{
+    cJSON *res, *value;
+
+    value = cJSON_GetObjectItem(params, "value");
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "echo", value && value->valuestring ? value->valuestring : "");
+    return res;
+}
+
+// Sends back BLOB_LEN bytes of its "value"
+cJSON *service_blob(cJSON *params)
+{
+    cJSON *res, *value;
+    char *blob;
+
+    value = cJSON_GetObjectItem(params, "value");
+    blob = malloc(BLOB_LEN + 1);
+    if (!blob) return NULL;
+    memset(blob, value && value->valuestring ? value->valuestring[0] : '?', BLOB_LEN);
+    blob[BLOB_LEN] = 0;
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "blob", blob);
+    free(blob);
+    return res;
+}
+
+// Send "num" echo calls in one write and check their responses
+static int echo_batch(int sock, int num)
+{
+    char *buf, value[16];
+    unsigned int len = 0;
+    int i, ret = 0;
+
+    buf = malloc(num * 64);
+    for (i = 0; i < num; i++)
+    {
+        sprintf(value, "%d", i);
+        len += test_put_call(buf + len, "echo", value);
+    }
+    send(sock, buf, len, 0);
+    free(buf);
+
+    for (i = 0; i < num && ret == 0; i++)
+    {
+        sprintf(value, "%d", i);
+        ret = test_expect(sock, "echo", value);
+    }
+    return ret;
+}
+
+static int test_gather(void)
+{
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+
+    // Served in one step, sent by one call, a second one at most if the
+    // requests came in two reads
+    reset_counts();
+    ret = echo_batch(sock, BATCH_NUM);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(sendPackets == BATCH_NUM);
+    TEST_CHECK(sendCalls <= 2 && maxIovLen >= BATCH_NUM / 2);
+
+    // More than a call takes
+    reset_counts();
+    ret = echo_batch(sock, SESSION_IOV_MAX * 3);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(sendPackets == SESSION_IOV_MAX * 3);
+    TEST_CHECK(sendCalls >= 3 && maxIovLen <= SESSION_IOV_MAX);
+
+    close(sock);
+    return 0;
+}
+
+static int test_short_write(void)
+{
+    char buf[BLOB_NUM * 64], value[2];
+    unsigned int len = 0;
+    int sock, i, ret;
+    cJSON *res, *item;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    reset_counts();
+
+    // Written a chunk at a time, in between the socket is full
+    __atomic_store_n(&socketFull, 1, __ATOMIC_RELAXED);
+    value[1] = 0;
+    for (i = 0; i < BLOB_NUM; i++)
+    {
+        value[0] = 'a' + i;
+        len += test_put_call(buf + len, "blob", value);
+    }
+    send(sock, buf, len, 0);
+
+    for (i = 0, ret = 0; i < BLOB_NUM && ret == 0; i++)
+    {
+        res = recv_request_response(sock);
+        item = res ? cJSON_GetObjectItem(res, "blob") : NULL;
+        if (!item || !item->valuestring || strlen(item->valuestring) != BLOB_LEN || \
+            item->valuestring[0] != 'a' + i || item->valuestring[BLOB_LEN - 1] != 'a' + i)
+        {
+            printf("unexpected response %d\n", i);
+            ret = -1;
+        }
+        cJSON_Delete(res);
+    }
+    __atomic_store_n(&socketFull, 0, __ATOMIC_RELAXED);
+    close(sock);
+    TEST_CHECK(ret == 0);
+    TEST_CHECK(shortWrites > BLOB_NUM * BLOB_LEN / CHUNK_LEN);
+    return 0;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register("echo", &service_echo, NULL);
+    service_register("blob", &service_blob, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_gather();
+    if (ret == 0) ret = test_short_write();
+
+    test_server_close(&server, thread);
+
+    printf("corked_send: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
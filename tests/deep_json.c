@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_coroutine.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// Deeply nested requests used to crash the server: the recursive parser ran
+// out of reactor stack on a long frame of '[', and a request for a coroutine
+// service was freed recursively on the small coroutine stack. A request
+// nested too deep to parse closes its session, one too deep for a coroutine
+// gets "Call Invalid". Either way the server keeps serving.
+
+#define TEST_PORT 6101
+
+// Depth of the arrays and objects in "item", the request is small enough by now
+static int json_depth(cJSON *item)
+{
+    int depth = 0, d;
+
+    for (item = item ? item->child : NULL; item; item = item->next)
+    {
+        d = json_depth(item);
+        if (d > depth) depth = d;
+    }
+    return depth + 1;
+}
+
+// Coroutine, suspends and walks its params
+cJSON *service_walk(cJSON *params)
+{
+    cJSON *res;
+
+    coroutine_sleep(1);
+    res = cJSON_CreateObject();
+    cJSON_AddNumberToObject(res, "depth", json_depth(params));
+    return res;
+}
+
+// Inline, sends its params back
+cJSON *service_echo(cJSON *params)
+{
+    cJSON *res;
+
+    res = cJSON_CreateObject();
+    cJSON_AddItemToObject(res, "echo", cJSON_Duplicate(params, 1));
+    return res;
+}
+
+// A call with params nested "depth" deep, as arrays
+static char *deep_call(const char *function, int depth)
+{
+    char *text;
+    int len;
+
+    text = malloc(64 + strlen(function) + 2 * depth);
+    len = sprintf(text, "{\"call\":{\"function\":\"%s\",\"params\":", function);
+    memset(text + len, '[', depth);
+    memset(text + len + depth, ']', depth);
+    strcpy(text + len + 2 * depth, "}}");
+    return text;
+}
+
+// Send a packet, returns the response or NULL if the session got closed
+static cJSON *call_packet(int sock, const char *data, unsigned int len)
+{
+    char *buf;
+
+    buf = malloc(len + PACKET_HEADER_EXT_LEN);
+    len = test_put_packet(buf, data, len);
+    send(sock, buf, len, 0);
+    free(buf);
+    return recv_request_response(sock);
+}
+
+// Call "function" with params nested "depth" deep
+static cJSON *call_deep(unsigned short port, const char *function, int depth)
+{
+    cJSON *res;
+    char *text;
+    int sock;
+
+    sock = test_connect(port);
+    if (sock < 0) return NULL;
+    text = deep_call(function, depth);
+    res = call_packet(sock, text, strlen(text));
+    free(text);
+    close(sock);
+    return res;
+}
+
+// The session is closed without a response
+static int expect_closed(int sock)
+{
+    char c;
+
+    return (recv(sock, &c, 1, 0) == 0) ? 0 : -1;
+}
+
+static int test_coroutine(void)
+{
+    cJSON *res, *item;
+    char *text;
+    int sock;
+
+    // Shallow enough to run in the coroutine
+    res = call_deep(TEST_PORT, "walk", 32);
+    TEST_CHECK(res != NULL);
+    item = cJSON_GetObjectItem(res, "depth");
+    TEST_CHECK(item != NULL && item->valueint == 32);
+    cJSON_Delete(res);
+
+    // Parsed, but too deep for a coroutine
+    res = call_deep(TEST_PORT, "walk", 500);
+    TEST_CHECK(res != NULL);
+    item = cJSON_GetObjectItem(res, "ret");
+    item = item ? cJSON_GetObjectItem(item, "code") : NULL;
+    TEST_CHECK(item != NULL && item->valueint == -SERVICE_RET_INVALID);
+    cJSON_Delete(res);
+
+    // The request which crashed the server, too deep to parse now
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    text = deep_call("walk", 2000);
+    res = call_packet(sock, text, strlen(text));
+    free(text);
+    TEST_CHECK(res == NULL);
+    TEST_CHECK(expect_closed(sock) == 0);
+    close(sock);
+    return 0;
+}
+
+static int test_inline(void)
+{
+    cJSON *res;
+
+    // The reactor stack takes what parses
+    res = call_deep(TEST_PORT, "echo", 900);
+    TEST_CHECK(res != NULL);
+    TEST_CHECK(json_depth(cJSON_GetObjectItem(res, "echo")) == 900);
+    cJSON_Delete(res);
+    return 0;
+}
+
+static int test_long_frame(void)
+{
+    unsigned int len = 1024 * 1024;
+    cJSON *res;
+    char *text;
+    int sock;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    text = malloc(len);
+    memset(text, '[', len);
+    res = call_packet(sock, text, len);
+    free(text);
+    TEST_CHECK(res == NULL);
+    TEST_CHECK(expect_closed(sock) == 0);
+    close(sock);
+    return 0;
+}
+
+// The server is alive and well
+static int test_after(void)
+{
+    cJSON *res, *item;
+    char buf[256];
+    int sock;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    send(sock, buf, test_put_call(buf, "echo", "alive"), 0);
+    res = recv_request_response(sock);
+    close(sock);
+    TEST_CHECK(res != NULL);
+    item = cJSON_GetObjectItem(res, "echo");
+    item = item ? cJSON_GetObjectItem(item, "value") : NULL;
+    TEST_CHECK(item != NULL && item->valuestring && strcmp(item->valuestring, "alive") == 0);
+    cJSON_Delete(res);
+    return 0;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register_ex("walk", &service_walk, NULL, SERVICE_FLAG_COROUTINE);
+    service_register("echo", &service_echo, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_coroutine();
+    if (ret == 0) ret = test_inline();
+    if (ret == 0) ret = test_long_frame();
+    if (ret == 0) ret = test_after();
+
+    test_server_close(&server, thread);
+
+    printf("deep_json: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// Packets of 64KB and more are framed with an escaped 32-bit length. A
+// client sending such a header gets long responses framed the same way, and
+// still short headers for short responses. A client which never did can't
+// get a long response, and a length above the limit closes the session. The
+// client doesn't take such a length either.
+
+#define TEST_PORT 6102
+#define LONG_LEN 100000
+
+// Sends back a string of "value" bytes
+cJSON *service_blob(cJSON *params)
+{
+    cJSON *res, *value;
+    unsigned int len;
+    char *blob;
+
+    value = cJSON_GetObjectItem(params, "value");
+    len = value && value->valuestring ? atoi(value->valuestring) : 0;
+    blob = malloc(len + 1);
+    if (!blob) return NULL;
+    memset(blob, 'b', len);
+    blob[len] = 0;
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "blob", blob);
+    free(blob);
+    return res;
+}
+
+// Sends back its "value"
+cJSON *service_echo(cJSON *params)
+{
+    cJSON *res, *value;
+
+    value = cJSON_GetObjectItem(params, "value");
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "echo", value && value->valuestring ? value->valuestring : "");
+    return res;
+}
+
+// Receive a response, "headerLen" gets the length of its header
+static cJSON *recv_packet(int sock, unsigned int *headerLen)
+{
+    unsigned short netLen;
+    unsigned int len, extLen;
+    cJSON *res;
+    char *data;
+
+    if (recv(sock, &netLen, 2, MSG_WAITALL) != 2) return NULL;
+    len = ntohs(netLen);
+    *headerLen = PACKET_HEADER_LEN;
+    if (len == PACKET_LEN_ESCAPE)
+    {
+        if (recv(sock, &extLen, 4, MSG_WAITALL) != 4) return NULL;
+        len = ntohl(extLen);
+        *headerLen = PACKET_HEADER_EXT_LEN;
+    }
+    data = malloc(len + 1);
+    if (!data) return NULL;
+    if (recv(sock, data, len, MSG_WAITALL) != (ssize_t)len)
+    {
+        free(data);
+        return NULL;
+    }
+    data[len] = 0;
+    res = cJSON_Parse(data);
+    free(data);
+    return res;
+}
+
+// Check the "name" string of a response is "len" bytes of "c"
+static int check_string(cJSON *res, const char *name, char c, unsigned int len)
+{
+    cJSON *item;
+    unsigned int i;
+
+    item = res ? cJSON_GetObjectItem(res, name) : NULL;
+    TEST_CHECK(item != NULL && item->valuestring != NULL);
+    TEST_CHECK(strlen(item->valuestring) == len);
+    for (i = 0; i < len; i++)
+    {
+        TEST_CHECK(item->valuestring[i] == c);
+    }
+    return 0;
+}
+
+// Send a call with a "value" of "len" bytes of 'v'
+static void send_long_call(int sock, const char *function, unsigned int len)
+{
+    char *value, *buf;
+
+    value = malloc(len + 1);
+    buf = malloc(len + 256);
+    memset(value, 'v', len);
+    value[len] = 0;
+    send(sock, buf, test_put_call(buf, function, value), 0);
+    free(buf);
+    free(value);
+}
+
+static int test_long_request(void)
+{
+    unsigned int headerLen, len;
+    char buf[256];
+    cJSON *res;
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+
+    // Long both ways
+    send_long_call(sock, "echo", LONG_LEN);
+    res = recv_packet(sock, &headerLen);
+    ret = check_string(res, "echo", 'v', LONG_LEN);
+    cJSON_Delete(res);
+    TEST_CHECK(ret == 0 && headerLen == PACKET_HEADER_EXT_LEN);
+
+    // A request of exactly PACKET_LEN_ESCAPE bytes is escaped as well, its
+    // response is a bit shorter and gets a short header
+    len = PACKET_LEN_ESCAPE - (test_put_call(buf, "echo", "") - PACKET_HEADER_LEN);
+    send_long_call(sock, "echo", len);
+    res = recv_packet(sock, &headerLen);
+    ret = check_string(res, "echo", 'v', len);
+    cJSON_Delete(res);
+    TEST_CHECK(ret == 0 && headerLen == PACKET_HEADER_LEN);
+
+    // A short request may get a long response, escaped
+    sprintf(buf, "%u", LONG_LEN);
+    send(sock, buf + 16, test_put_call(buf + 16, "blob", buf), 0);
+    res = recv_packet(sock, &headerLen);
+    ret = check_string(res, "blob", 'b', LONG_LEN);
+    cJSON_Delete(res);
+    TEST_CHECK(ret == 0 && headerLen == PACKET_HEADER_EXT_LEN);
+
+    close(sock);
+    return 0;
+}
+
+static int test_short_client(void)
+{
+    unsigned int headerLen;
+    char buf[256];
+    cJSON *res;
+    int sock;
+
+    // Never sent an extended header, it can't read a long response
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    sprintf(buf, "%u", LONG_LEN);
+    send(sock, buf + 16, test_put_call(buf + 16, "blob", buf), 0);
+    res = recv_packet(sock, &headerLen);
+    TEST_CHECK(res == NULL);
+    close(sock);
+    return 0;
+}
+
+static int test_too_long(void)
+{
+    unsigned short netLen;
+    unsigned int extLen;
+    char buf[PACKET_HEADER_EXT_LEN + 16], c;
+    int sock;
+
+    // Closed as soon as the header is in, the rest never comes
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    netLen = htons(PACKET_LEN_ESCAPE);
+    extLen = htonl(SESSION_PACKET_MAX + 1);
+    memcpy(buf, &netLen, 2);
+    memcpy(buf + 2, &extLen, 4);
+    memset(buf + PACKET_HEADER_EXT_LEN, '[', 16);
+    send(sock, buf, sizeof(buf), 0);
+    TEST_CHECK(recv(sock, &c, 1, 0) == 0);
+    close(sock);
+    return 0;
+}
+
+static int test_client_limit(void)
+{
+    unsigned short netLen;
+    unsigned int extLen;
+    char buf[PACKET_HEADER_EXT_LEN];
+    struct timeval tv;
+    int socks[2];
+
+    // The client doesn't allocate whatever length the peer announces
+    TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    setsockopt(socks[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    netLen = htons(PACKET_LEN_ESCAPE);
+    extLen = htonl(0xffffffff);
+    memcpy(buf, &netLen, 2);
+    memcpy(buf + 2, &extLen, 4);
+    send(socks[1], buf, sizeof(buf), 0);
+    TEST_CHECK(recv_request_response(socks[0]) == NULL);
+    close(socks[0]);
+    close(socks[1]);
+    return 0;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register("blob", &service_blob, NULL);
+    service_register("echo", &service_echo, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_long_request();
+    if (ret == 0) ret = test_short_client();
+    if (ret == 0) ret = test_too_long();
+    if (ret == 0) ret = test_client_limit();
+
+    test_server_close(&server, thread);
+
+    printf("ext_frame: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
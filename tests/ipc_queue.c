@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_scheduler.h"
+#include "test_util.h"
+
+// Several threads post tasks to a scheduler through its IPC queue at once.
+// Every task runs once on the scheduler thread, and the tasks of a thread
+// run in the order that thread posted them.
+
+#define PRODUCER_NUM 4
+#define TASK_NUM 20000 // per producer
+
+static SchedulerT *scheduler;
+static int lastSeq[PRODUCER_NUM];
+static int ranNum;
+static int cleanedNum;
+static int outOfOrder;
+static int postErrors;
+
+static void task_proc(void *data)
+{
+    long v = (long)data;
+    int producer = (int)(v / TASK_NUM), seq = (int)(v % TASK_NUM);
+
+    if (seq != lastSeq[producer] + 1) outOfOrder++;
+    lastSeq[producer] = seq;
+    ranNum++;
+}
+
+static void task_cleanup(void *data)
+{
+    cleanedNum++;
+}
+
+static void *producer_thread(void *param)
+{
+    long producer = (long)param;
+    int i;
+
+    for (i = 0; i < TASK_NUM; i++)
+    {
+        if (scheduler_delay_task_remote(scheduler, 0, DELAYTASK_FLAG_ONESHOT, task_proc, \
+                                        (void *)(producer * TASK_NUM + i), task_cleanup) != ERR_SCHEDULER_OK)
+        {
+            __atomic_add_fetch(&postErrors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int test_producers(void)
+{
+    pthread_t threads[PRODUCER_NUM];
+    long i;
+    int steps;
+
+    for (i = 0; i < PRODUCER_NUM; i++)
+    {
+        lastSeq[i] = -1;
+        TEST_CHECK(pthread_create(&threads[i], NULL, producer_thread, (void *)i) == 0);
+    }
+    // Served while they are posting, until the last task ran
+    for (steps = 0; ranNum < PRODUCER_NUM * TASK_NUM && steps < 100000; steps++)
+    {
+        scheduler_single_step(scheduler, 10);
+    }
+    for (i = 0; i < PRODUCER_NUM; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    TEST_CHECK(postErrors == 0);
+    TEST_CHECK(ranNum == PRODUCER_NUM * TASK_NUM);
+    TEST_CHECK(cleanedNum == PRODUCER_NUM * TASK_NUM);
+    TEST_CHECK(outOfOrder == 0);
+    return 0;
+}
+
+int main(void)
+{
+    SchedulerParamT param;
+    int ret;
+
+    memset(&param, 0, sizeof(param));
+    param.enableIPC = 1;
+    if (scheduler_open(&scheduler, &param) != ERR_SCHEDULER_OK)
+    {
+        printf("scheduler err...\n");
+        return 1;
+    }
+
+    ret = test_producers();
+
+    scheduler_close(&scheduler);
+
+    printf("ipc_queue: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
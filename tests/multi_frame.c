@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// The server reads what the socket has and serves every whole packet of it:
+// many packets in one read, packets split anywhere across reads, a packet
+// longer than the receive buffer among short ones, and empty packets which
+// are skipped.
+
+#define TEST_PORT 6103
+#define BATCH_NUM 50
+
+// Sends back its "value"
+cJSON *service_echo(cJSON *params)
+{
+    cJSON *res, *value;
+
+    value = cJSON_GetObjectItem(params, "value");
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "echo", value && value->valuestring ? value->valuestring : "");
+    return res;
+}
+
+static int test_batch(void)
+{
+    char *buf, value[16];
+    unsigned int len = 0;
+    int sock, i, ret = 0;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    buf = malloc(BATCH_NUM * 128);
+    for (i = 0; i < BATCH_NUM; i++)
+    {
+        sprintf(value, "%d", i);
+        len += test_put_call(buf + len, "echo", value);
+        // An empty packet now and then, nothing answers it
+        if (i % 10 == 0) len += test_put_packet(buf + len, "", 0);
+    }
+    send(sock, buf, len, 0);
+    free(buf);
+
+    for (i = 0; i < BATCH_NUM && ret == 0; i++)
+    {
+        sprintf(value, "%d", i);
+        ret = test_expect(sock, "echo", value);
+    }
+    close(sock);
+    TEST_CHECK(ret == 0);
+    return 0;
+}
+
+static int test_split(void)
+{
+    char buf[512];
+    unsigned int len = 0, i;
+    int sock, one = 1, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    len += test_put_call(buf + len, "echo", "first");
+    len += test_put_call(buf + len, "echo", "second");
+    len += test_put_call(buf + len, "echo", "third");
+
+    // A byte at a time, headers split as well
+    for (i = 0; i < len; i++)
+    {
+        send(sock, buf + i, 1, 0);
+        usleep(200);
+    }
+    ret = test_expect(sock, "echo", "first");
+    if (ret == 0) ret = test_expect(sock, "echo", "second");
+    if (ret == 0) ret = test_expect(sock, "echo", "third");
+    close(sock);
+    TEST_CHECK(ret == 0);
+    return 0;
+}
+
+static int test_long_among_short(void)
+{
+    char *buf, *value;
+    unsigned int len = 0, valueLen = SESSION_BUFFER_SIZE * 3;
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+    buf = malloc(valueLen + 512);
+    value = malloc(valueLen + 1);
+    memset(value, 'v', valueLen);
+    value[valueLen] = 0;
+
+    len += test_put_call(buf + len, "echo", "before");
+    len += test_put_call(buf + len, "echo", value);
+    len += test_put_call(buf + len, "echo", "after");
+    send(sock, buf, len, 0);
+    free(buf);
+
+    ret = test_expect(sock, "echo", "before");
+    if (ret == 0) ret = test_expect(sock, "echo", value);
+    if (ret == 0) ret = test_expect(sock, "echo", "after");
+    free(value);
+    close(sock);
+    TEST_CHECK(ret == 0);
+    return 0;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register("echo", &service_echo, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_batch();
+    if (ret == 0) ret = test_split();
+    if (ret == 0) ret = test_long_among_short();
+
+    test_server_close(&server, thread);
+
+    printf("multi_frame: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
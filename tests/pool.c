@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "net_pool.h"
+#include "test_util.h"
+
+// Objects of a pool don't overlap and are aligned like malloc() does, freed
+// ones are taken again before a new slab, and slabs left empty go back to
+// the system but one, kept for the next burst.
+
+#define OBJ_SIZE 40
+
+static int test_alloc_free(void)
+{
+    PoolStatsT stats;
+    PoolT *pool;
+    unsigned char **objs;
+    unsigned int i, j, num;
+
+    TEST_CHECK(pool_open(&pool, OBJ_SIZE) == ERR_POOL_OK);
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.objSize >= OBJ_SIZE && stats.slabObjNum > 1);
+
+    // A few slabs and a partial one
+    num = stats.slabObjNum * 3 + stats.slabObjNum / 2;
+    objs = malloc(num * sizeof(*objs));
+    TEST_CHECK(objs != NULL);
+    for (i = 0; i < num; i++)
+    {
+        objs[i] = pool_alloc(pool);
+        TEST_CHECK(objs[i] != NULL);
+        TEST_CHECK(((unsigned long)objs[i] & 15) == 0);
+        memset(objs[i], (unsigned char)i, OBJ_SIZE);
+    }
+    for (i = 0; i < num; i++)
+    {
+        for (j = 0; j < OBJ_SIZE; j++)
+        {
+            TEST_CHECK(objs[i][j] == (unsigned char)i);
+        }
+    }
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.usedNum == num && stats.peakNum == num && stats.allocNum == num);
+    TEST_CHECK(stats.slabNum == 4 && stats.slabAllocNum == 4 && stats.emptySlabNum == 0);
+
+    // Every other one goes, the holes are filled before any new slab
+    for (i = 0; i < num; i += 2)
+    {
+        pool_free(pool, objs[i]);
+    }
+    for (i = 0; i < num; i += 2)
+    {
+        objs[i] = pool_alloc(pool);
+        TEST_CHECK(objs[i] != NULL);
+    }
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.usedNum == num && stats.slabAllocNum == 4);
+
+    // All of them go, one empty slab stays
+    pool_free(pool, NULL);
+    for (i = 0; i < num; i++)
+    {
+        pool_free(pool, objs[i]);
+    }
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.usedNum == 0 && stats.peakNum == num);
+    TEST_CHECK(stats.slabNum == 1 && stats.emptySlabNum == 1 && stats.slabFreeNum == 3);
+
+    // The kept slab serves the next one, trimming gives it back
+    objs[0] = pool_alloc(pool);
+    TEST_CHECK(objs[0] != NULL);
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.slabAllocNum == 4 && stats.emptySlabNum == 0);
+    pool_free(pool, objs[0]);
+    TEST_CHECK(pool_trim(pool) == ERR_POOL_OK);
+    TEST_CHECK(pool_get_stats(pool, &stats) == ERR_POOL_OK);
+    TEST_CHECK(stats.slabNum == 0 && stats.bytes == 0);
+
+    free(objs);
+    TEST_CHECK(pool_close(&pool) == ERR_POOL_OK && pool == NULL);
+    return 0;
+}
+
+static int test_close_in_use(void)
+{
+    PoolT *pool;
+    int i;
+
+    // Objects smaller than a free list link, some still in use on close
+    TEST_CHECK(pool_open(&pool, 1) == ERR_POOL_OK);
+    for (i = 0; i < 100; i++)
+    {
+        TEST_CHECK(pool_alloc(pool) != NULL);
+    }
+    TEST_CHECK(pool_close(&pool) == ERR_POOL_OK);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    ret = test_alloc_free();
+    if (ret == 0) ret = test_close_in_use();
+
+    printf("pool: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
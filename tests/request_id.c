@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_service.h"
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+#include "test_util.h"
+
+// A request with an "id" gets it back, error responses included, and its
+// response goes out as soon as it is ready: before the responses of the
+// requests sent earlier when they take longer. The responses of requests
+// without an id keep their order.
+
+#define TEST_PORT 6104
+
+static ServiceCallT *heldCall;
+
+// Async, answered by "release"
+void service_hold(cJSON *params, ServiceCallT *call)
+{
+    heldCall = call;
+}
+
+// Inline, answers the held call
+cJSON *service_release(cJSON *params)
+{
+    cJSON *res;
+
+    if (heldCall)
+    {
+        res = cJSON_CreateObject();
+        cJSON_AddStringToObject(res, "hold", "released");
+        service_complete(heldCall, res);
+        heldCall = NULL;
+    }
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "release", "done");
+    return res;
+}
+
+// Offloaded to a worker, takes a while
+cJSON *service_slow(cJSON *params)
+{
+    cJSON *res;
+
+    usleep(100000);
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "slow", "done");
+    return res;
+}
+
+// Sends back its "value"
+cJSON *service_echo(cJSON *params)
+{
+    cJSON *res, *value;
+
+    value = cJSON_GetObjectItem(params, "value");
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "echo", value && value->valuestring ? value->valuestring : "");
+    return res;
+}
+
+// Append a call with the "id" given as JSON text, none if NULL
+static unsigned int put_id_call(char *buf, const char *function, const char *value, const char *id)
+{
+    cJSON *root, *call, *params;
+    unsigned int len;
+    char *out;
+
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "call", call=cJSON_CreateObject());
+    cJSON_AddStringToObject(call, "function", function);
+    cJSON_AddItemToObject(call, "params", params=cJSON_CreateObject());
+    cJSON_AddStringToObject(params, "value", value);
+    if (id) cJSON_AddItemToObject(root, "id", cJSON_Parse(id));
+    out = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    len = test_put_packet(buf, out, strlen(out));
+    free(out);
+    return len;
+}
+
+// Receive a response, check one of its string items and its id
+static int expect_id(int sock, const char *name, const char *value, const char *id)
+{
+    cJSON *res, *item;
+    char *out;
+    int ret = 0;
+
+    res = recv_request_response(sock);
+    TEST_CHECK(res != NULL);
+    item = cJSON_GetObjectItem(res, name);
+    if (value && !(item && item->valuestring && strcmp(item->valuestring, value) == 0)) ret = -1;
+    if (!value && !item) ret = -1;
+    item = cJSON_GetObjectItem(res, "id");
+    out = item ? cJSON_PrintUnformatted(item) : NULL;
+    if (id ? !(out && strcmp(out, id) == 0) : (out != NULL)) ret = -1;
+    if (out) free(out);
+    if (ret != 0)
+    {
+        out = cJSON_PrintUnformatted(res);
+        printf("unexpected response: %s\n", out);
+        free(out);
+    }
+    cJSON_Delete(res);
+    return ret;
+}
+
+static int test_async_id(void)
+{
+    char buf[1024];
+    unsigned int len = 0;
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+
+    // The held call doesn't hold back the others, with an id or not
+    len += put_id_call(buf + len, "hold", "", "1");
+    len += put_id_call(buf + len, "echo", "two", "\"two\"");
+    len += put_id_call(buf + len, "echo", "plain", NULL);
+    len += put_id_call(buf + len, "echo", "four", "{\"n\":[4,\"four\"]}");
+    send(sock, buf, len, 0);
+    ret = expect_id(sock, "echo", "two", "\"two\"");
+    if (ret == 0) ret = expect_id(sock, "echo", "plain", NULL);
+    if (ret == 0) ret = expect_id(sock, "echo", "four", "{\"n\":[4,\"four\"]}");
+
+    // Answered once released, the completion is posted to the reactor so
+    // the release is answered first
+    if (ret == 0)
+    {
+        send(sock, buf, put_id_call(buf, "release", "", NULL), 0);
+        ret = expect_id(sock, "release", "done", NULL);
+        if (ret == 0) ret = expect_id(sock, "hold", "released", "1");
+    }
+    close(sock);
+    TEST_CHECK(ret == 0);
+    return 0;
+}
+
+static int test_offload_id(void)
+{
+    char buf[1024];
+    unsigned int len = 0;
+    int sock, ret;
+
+    sock = test_connect(TEST_PORT);
+    TEST_CHECK(sock >= 0);
+
+    // The slow one is answered last, its id tells which one it is
+    len += put_id_call(buf + len, "slow", "", "3");
+    len += put_id_call(buf + len, "echo", "four", "4");
+    len += put_id_call(buf + len, "nothing", "", "5");
+    send(sock, buf, len, 0);
+    ret = expect_id(sock, "echo", "four", "4");
+    // Errors carry the id as well
+    if (ret == 0) ret = expect_id(sock, "ret", NULL, "5");
+    if (ret == 0) ret = expect_id(sock, "slow", "done", "3");
+    close(sock);
+    TEST_CHECK(ret == 0);
+    return 0;
+}
+
+int main(void)
+{
+    ServerT *server;
+    pthread_t thread;
+    int ret;
+
+    service_init();
+    service_register_async("hold", &service_hold, NULL);
+    service_register("release", &service_release, NULL);
+    service_register_ex("slow", &service_slow, NULL, SERVICE_FLAG_OFFLOAD);
+    service_register("echo", &service_echo, NULL);
+    if (test_server_open(&server, &thread, TEST_PORT) < 0) return 1;
+
+    ret = test_async_id();
+    if (ret == 0) ret = test_offload_id();
+
+    test_server_close(&server, thread);
+
+    printf("request_id: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "net_scheduler.h"
+#include "test_util.h"
+
+// A delayed task id stops matching once its task is gone, even when a new
+// task got the same slot. Stale ids neither cancel nor move the new task.
+// A task may cancel itself while it runs.
+
+static SchedulerT *scheduler;
+static int ranNum;
+static int cleanedNum;
+static SchedTaskIdT selfId;
+
+static void task_proc(void *data)
+{
+    ranNum++;
+}
+
+static void task_cleanup(void *data)
+{
+    cleanedNum++;
+}
+
+static void self_cancel_proc(void *data)
+{
+    ranNum++;
+    if (ranNum == 3) scheduler_undelay_task(scheduler, selfId);
+}
+
+// Step until "num" tasks ran, or for a while
+static void run_until(int num)
+{
+    int steps;
+
+    for (steps = 0; ranNum < num && steps < 200; steps++)
+    {
+        scheduler_single_step(scheduler, 5);
+    }
+}
+
+static int test_stale_id(void)
+{
+    SchedTaskIdT oldId, newId;
+
+    ranNum = cleanedNum = 0;
+    oldId = scheduler_delay_task(scheduler, 1, DELAYTASK_FLAG_ONESHOT, task_proc, NULL, task_cleanup);
+    TEST_CHECK(oldId != SCHED_TASK_ID_INVALID);
+    run_until(1);
+    TEST_CHECK(ranNum == 1 && cleanedNum == 1);
+    TEST_CHECK(scheduler_undelay_task(scheduler, oldId) == ERR_SCHEDULER_TASK_NOT_FOUND);
+
+    // The freed slot is taken again, with another generation
+    newId = scheduler_delay_task(scheduler, 1000, DELAYTASK_FLAG_ONESHOT, task_proc, NULL, task_cleanup);
+    TEST_CHECK(newId != SCHED_TASK_ID_INVALID && newId != oldId);
+    TEST_CHECK((unsigned int)newId == (unsigned int)oldId);
+    TEST_CHECK(scheduler_undelay_task(scheduler, oldId) == ERR_SCHEDULER_TASK_NOT_FOUND);
+    TEST_CHECK(scheduler_reschedule_task(scheduler, oldId, 0) == ERR_SCHEDULER_TASK_NOT_FOUND);
+    TEST_CHECK(cleanedNum == 1);
+
+    // Still there, and cancelled once only
+    TEST_CHECK(scheduler_undelay_task(scheduler, newId) > 0);
+    TEST_CHECK(cleanedNum == 2);
+    TEST_CHECK(scheduler_undelay_task(scheduler, newId) == ERR_SCHEDULER_TASK_NOT_FOUND);
+    TEST_CHECK(ranNum == 1);
+    return 0;
+}
+
+static int test_self_cancel(void)
+{
+    int steps;
+
+    ranNum = cleanedNum = 0;
+    selfId = scheduler_delay_task(scheduler, 1, DELAYTASK_FLAG_PERIODIC, self_cancel_proc, NULL, task_cleanup);
+    TEST_CHECK(selfId != SCHED_TASK_ID_INVALID);
+    run_until(3);
+    // A few more periods, it must not run again
+    for (steps = 0; steps < 5; steps++)
+    {
+        scheduler_single_step(scheduler, 2);
+    }
+    TEST_CHECK(ranNum == 3);
+    TEST_CHECK(cleanedNum == 1);
+    TEST_CHECK(scheduler_undelay_task(scheduler, selfId) == ERR_SCHEDULER_TASK_NOT_FOUND);
+    return 0;
+}
+
+int main(void)
+{
+    SchedulerParamT param;
+    int ret;
+
+    memset(&param, 0, sizeof(param));
+    if (scheduler_open(&scheduler, &param) != ERR_SCHEDULER_OK)
+    {
+        printf("scheduler err...\n");
+        return 1;
+    }
+
+    ret = test_stale_id();
+    if (ret == 0) ret = test_self_cancel();
+
+    scheduler_close(&scheduler);
+
+    printf("task_id: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
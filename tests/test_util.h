@@ -0,0 +1,160 @@
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net_server.h"
+#include "net_comm.h"
+#include "cJSON.h"
+
+// Helpers shared by the tests, each test is a program of its own which
+// exits with 0 when it passes
+
+// Fail the calling test function if "cond" doesn't hold
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+static inline void *test_server_thread(void *param)
+{
+    server_start((ServerT *)param);
+    return NULL;
+}
+
+// Open a server with one reactor on "port" and run it on a thread of its own
+static inline int test_server_open(ServerT **pServer, pthread_t *thread, unsigned short port)
+{
+    ServerParamT param;
+
+    memset(&param, 0, sizeof(param));
+    param.port = port;
+    param.reactorNum = 1;
+    server_init();
+    if (server_open(pServer, &param) < 0)
+    {
+        printf("server err...\n");
+        return -1;
+    }
+    // The socket listens already, the connections wait for the reactor
+    pthread_create(thread, NULL, test_server_thread, *pServer);
+    return 0;
+}
+
+static inline void test_server_close(ServerT **pServer, pthread_t thread)
+{
+    server_stop(*pServer);
+    pthread_join(thread, NULL);
+    server_close(pServer);
+}
+
+// Connect to the server, a response that doesn't come fails after 5 seconds
+static inline int test_connect(unsigned short port)
+{
+    struct sockaddr_in server;
+    struct timeval tv;
+    int sock;
+
+    sock = socket(PF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0)
+    {
+        printf("connect error!\n");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Append a packet of "len" bytes to "buf", returns the bytes added
+static inline unsigned int test_put_packet(char *buf, const char *data, unsigned int len)
+{
+    unsigned short netLen;
+    unsigned int extLen, headerLen = PACKET_HEADER_LEN;
+
+    if (len >= PACKET_LEN_ESCAPE)
+    {
+        netLen = htons(PACKET_LEN_ESCAPE);
+        extLen = htonl(len);
+        memcpy(buf + PACKET_HEADER_LEN, &extLen, 4);
+        headerLen = PACKET_HEADER_EXT_LEN;
+    }
+    else
+    {
+        netLen = htons((unsigned short)len);
+    }
+    memcpy(buf, &netLen, 2);
+    memcpy(buf + headerLen, data, len);
+    return headerLen + len;
+}
+
+// Append a call packet to "buf", its params have a "value", returns the bytes added
+static inline unsigned int test_put_call(char *buf, const char *function, const char *value)
+{
+    cJSON *root, *call, *params;
+    unsigned int len;
+    char *out;
+
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "call", call=cJSON_CreateObject());
+    cJSON_AddStringToObject(call, "function", function);
+    cJSON_AddItemToObject(call, "params", params=cJSON_CreateObject());
+    cJSON_AddStringToObject(params, "value", value);
+    out = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    len = test_put_packet(buf, out, strlen(out));
+    free(out);
+    return len;
+}
+
+// Receive a response and check one of its string items
+static inline int test_expect(int sock, const char *name, const char *value)
+{
+    cJSON *res, *item;
+    char *out;
+    int ret = -1;
+
+    res = recv_request_response(sock);
+    if (!res)
+    {
+        printf("no response for \"%s\"\n", name);
+        return -1;
+    }
+    item = cJSON_GetObjectItem(res, name);
+    if (item && item->valuestring && strcmp(item->valuestring, value) == 0)
+    {
+        ret = 0;
+    }
+    else
+    {
+        out = cJSON_PrintUnformatted(res);
+        printf("unexpected response: %s\n", out);
+        free(out);
+    }
+    cJSON_Delete(res);
+    return ret;
+}
+
+#endif // __TEST_UTIL_H__
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "net_scheduler.h"
+#include "test_util.h"
+
+// Delayed tasks run in the order of their timeouts, the tasks due at the
+// same time in the order they were added. A cancelled task never runs, and
+// every task gets its Cleanup function called once.
+
+#define TASK_NUM 64
+
+static int fired[TASK_NUM];
+static int firedNum;
+static int cleaned[TASK_NUM];
+
+// Delay of task "i" in millisecond, several tasks share each one
+static unsigned int task_delay(int i)
+{
+    return (i * 7) % 16 * 2;
+}
+
+static void task_proc(void *data)
+{
+    fired[firedNum++] = (int)(long)data;
+}
+
+static void task_cleanup(void *data)
+{
+    cleaned[(int)(long)data]++;
+}
+
+static int test_order(SchedulerT *scheduler)
+{
+    SchedTaskIdT ids[TASK_NUM];
+    int i, steps, a, b;
+
+    for (i = 0; i < TASK_NUM; i++)
+    {
+        ids[i] = scheduler_delay_task(scheduler, task_delay(i), DELAYTASK_FLAG_ONESHOT, \
+                                      task_proc, (void *)(long)i, task_cleanup);
+        TEST_CHECK(ids[i] != SCHED_TASK_ID_INVALID);
+    }
+    // Every fourth one goes, from the middle of the heap as well as from its top
+    for (i = 0; i < TASK_NUM; i += 4)
+    {
+        TEST_CHECK(scheduler_undelay_task(scheduler, ids[i]) >= 0);
+        TEST_CHECK(cleaned[i] == 1);
+    }
+
+    for (steps = 0; firedNum < TASK_NUM - TASK_NUM/4 && steps < 1000; steps++)
+    {
+        scheduler_single_step(scheduler, 5);
+    }
+    TEST_CHECK(firedNum == TASK_NUM - TASK_NUM/4);
+
+    for (i = 0; i < firedNum; i++)
+    {
+        TEST_CHECK(fired[i] % 4 != 0);
+        if (i == 0) continue;
+        a = fired[i - 1];
+        b = fired[i];
+        TEST_CHECK(task_delay(a) < task_delay(b) || (task_delay(a) == task_delay(b) && a < b));
+    }
+    for (i = 0; i < TASK_NUM; i++)
+    {
+        TEST_CHECK(cleaned[i] == 1);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    SchedulerParamT param;
+    SchedulerT *scheduler;
+    int ret;
+
+    memset(&param, 0, sizeof(param));
+    if (scheduler_open(&scheduler, &param) != ERR_SCHEDULER_OK)
+    {
+        printf("scheduler err...\n");
+        return 1;
+    }
+
+    ret = test_order(scheduler);
+
+    scheduler_close(&scheduler);
+
+    printf("timer_heap: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "net_worker.h"
+#include "test_util.h"
+
+// Subtasks spawned by a job go on the Chase-Lev deque of its worker, the
+// idle workers steal them from there, and joining gives every result back.
+// A full queue turns jobs down, and closing the pool cleans up the jobs
+// that didn't run.
+
+#define THREAD_NUM 4
+#define LEAF_LEN 64 // numbers summed by one subtask
+
+typedef struct _RangeT
+{
+    int lo, hi;
+    long long sum;
+} RangeT;
+
+static pthread_t leafThreads[THREAD_NUM * 4];
+static int leafThreadNum;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int started, released, ranNum, cleanedNum;
+
+static void note_thread(void)
+{
+    pthread_t self = pthread_self();
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < leafThreadNum && !pthread_equal(leafThreads[i], self); i++);
+    if (i == leafThreadNum && leafThreadNum < THREAD_NUM * 4) leafThreads[leafThreadNum++] = self;
+    pthread_mutex_unlock(&lock);
+}
+
+// Split the range in two subtasks until it is small enough
+static void range_sum(void *data)
+{
+    RangeT *r = (RangeT *)data, left, right;
+    WorkerTaskT *leftTask, *rightTask;
+    int i;
+
+    if (r->hi - r->lo <= LEAF_LEN)
+    {
+        note_thread();
+        // Long enough for the other workers to come and steal
+        usleep(1000);
+        for (r->sum = 0, i = r->lo; i < r->hi; i++) r->sum += i;
+        return;
+    }
+    left.lo = r->lo;
+    left.hi = right.lo = (r->lo + r->hi) / 2;
+    right.hi = r->hi;
+    if (worker_spawn(&leftTask, range_sum, &left) != ERR_WORKER_OK || \
+        worker_spawn(&rightTask, range_sum, &right) != ERR_WORKER_OK)
+    {
+        r->sum = -1;
+        return;
+    }
+    worker_join(rightTask);
+    worker_join(leftTask);
+    r->sum = left.sum + right.sum;
+}
+
+static void job_done(void *data)
+{
+    pthread_mutex_lock(&lock);
+    cleanedNum++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static int test_steal(void)
+{
+    WorkerParamT param;
+    WorkerPoolT *pool;
+    RangeT r;
+    int ret;
+
+    memset(&param, 0, sizeof(param));
+    param.threadNum = THREAD_NUM;
+    TEST_CHECK(worker_pool_open(&pool, &param) == ERR_WORKER_OK);
+
+    r.lo = 0;
+    r.hi = LEAF_LEN * 64;
+    r.sum = 0;
+    cleanedNum = 0;
+    ret = worker_pool_submit(pool, range_sum, &r, job_done);
+    if (ret == ERR_WORKER_OK)
+    {
+        pthread_mutex_lock(&lock);
+        while (cleanedNum < 1) pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+    }
+    worker_pool_close(&pool);
+
+    TEST_CHECK(ret == ERR_WORKER_OK);
+    TEST_CHECK(r.sum == (long long)r.hi * (r.hi - 1) / 2);
+    // One job, yet its subtasks ran on several workers
+    TEST_CHECK(leafThreadNum > 1);
+    return 0;
+}
+
+static int test_spawn_off_pool(void)
+{
+    WorkerTaskT *task;
+    RangeT r;
+
+    // Not on a pool, the subtask runs right away
+    r.lo = 0;
+    r.hi = LEAF_LEN;
+    r.sum = 0;
+    TEST_CHECK(worker_spawn(&task, range_sum, &r) == ERR_WORKER_OK);
+    TEST_CHECK(r.sum == (long long)r.hi * (r.hi - 1) / 2);
+    TEST_CHECK(worker_join(task) == ERR_WORKER_OK);
+    return 0;
+}
+
+// Holds the only worker until released
+static void blocker(void *data)
+{
+    pthread_mutex_lock(&lock);
+    started = 1;
+    pthread_cond_broadcast(&cond);
+    while (!released) pthread_cond_wait(&cond, &lock);
+    ranNum++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void counted(void *data)
+{
+    pthread_mutex_lock(&lock);
+    ranNum++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void *release_thread(void *param)
+{
+    usleep(50000);
+    pthread_mutex_lock(&lock);
+    released = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static int test_full_and_close(void)
+{
+    WorkerParamT param;
+    WorkerPoolT *pool;
+    pthread_t thread;
+    int i, ret, busy = ERR_WORKER_OK;
+
+    memset(&param, 0, sizeof(param));
+    param.threadNum = 1;
+    param.queueMax = 3;
+    TEST_CHECK(worker_pool_open(&pool, &param) == ERR_WORKER_OK);
+    started = released = ranNum = cleanedNum = 0;
+
+    ret = worker_pool_submit(pool, blocker, NULL, job_done);
+    if (ret == ERR_WORKER_OK)
+    {
+        pthread_mutex_lock(&lock);
+        while (!started) pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+        for (i = 0; i < param.queueMax && ret == ERR_WORKER_OK; i++)
+        {
+            ret = worker_pool_submit(pool, counted, NULL, job_done);
+        }
+        busy = worker_pool_submit(pool, counted, NULL, job_done);
+    }
+    // The queued jobs are still there when the worker is released
+    pthread_create(&thread, NULL, release_thread, NULL);
+    worker_pool_close(&pool);
+    pthread_join(thread, NULL);
+
+    TEST_CHECK(ret == ERR_WORKER_OK);
+    TEST_CHECK(busy == ERR_WORKER_BUSY);
+    TEST_CHECK(ranNum == 1);
+    TEST_CHECK(cleanedNum == 1 + param.queueMax);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    ret = test_steal();
+    if (ret == 0) ret = test_spawn_off_pool();
+    if (ret == 0) ret = test_full_and_close();
+
+    printf("worker_pool: %s\n", ret == 0 ? "PASS" : "FAIL");
+    return ret == 0 ? 0 : 1;
+}